@@ -17,60 +17,221 @@
 // Author: jefftk@google.com (Jeff Kaufman)
 
 #include "ngx_base_fetch.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <unistd.h>
+
 #include "ngx_pagespeed.h"
 #include "net/instaweb/http/public/response_headers.h"
 #include "net/instaweb/util/public/google_message_handler.h"
 #include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/string_util.h"
 
 namespace net_instaweb {
 
-NgxBaseFetch::NgxBaseFetch(ngx_http_request_t* r, int pipe_fd)
-    : request_(r), done_called_(false), last_buf_sent_(false),
-      pipe_fd_(pipe_fd) {
-  if (pthread_mutex_init(&mutex_, NULL)) CHECK(0);
-  PopulateRequestHeaders();
+namespace {
+
+// Default size of each output segment.  Large enough that a typical page goes
+// out as a handful of buffers.
+const size_t kDefaultSegmentSize = 32 * 1024;  // 32k
+
+// Size of the first segment allocated after a flush.
+const size_t kMinSegmentSize = 4 * 1024;  // 4k
+
+// Segment memory allocated by all base fetches in this worker process.
+volatile int64 worker_segment_bytes = 0;
+
+ngx_str_t spill_file_name = ngx_string("pagespeed output spill file");
+
+// A response header we see on nearly every resource.  These are interned, with
+// their nginx hashes computed once, so exporting them needs no allocation or
+// hashing.
+struct NgxKnownHeader {
+  ngx_str_t name;
+  ngx_str_t lowcase_name;
+  // Where in ngx_http_headers_out_t nginx keeps a pointer to this header, or
+  // one of the negative values below.
+  ssize_t shortcut_offset;
+  ngx_uint_t hash;  // Computed by InitKnownHeaders().
+};
+
+// No shortcut, just a list entry.
+const ssize_t kNoShortcut = -1;
+// headers_out.content_type, which is a string and not a list entry.
+const ssize_t kContentTypeShortcut = -2;
+
+#define PS_SHORTCUT(field) offsetof(ngx_http_headers_out_t, field)
+
+NgxKnownHeader known_headers[] = {
+  { ngx_string("Cache-Control"), ngx_string("cache-control"), kNoShortcut },
+  { ngx_string("Content-Encoding"), ngx_string("content-encoding"),
+    PS_SHORTCUT(content_encoding) },
+  { ngx_string("Content-Length"), ngx_string("content-length"),
+    PS_SHORTCUT(content_length) },
+  { ngx_string("Content-Type"), ngx_string("content-type"),
+    kContentTypeShortcut },
+  { ngx_string("Date"), ngx_string("date"), PS_SHORTCUT(date) },
+  { ngx_string("Etag"), ngx_string("etag"), PS_SHORTCUT(etag) },
+  { ngx_string("Expires"), ngx_string("expires"), PS_SHORTCUT(expires) },
+  { ngx_string("Last-Modified"), ngx_string("last-modified"),
+    PS_SHORTCUT(last_modified) },
+  { ngx_string("Link"), ngx_string("link"), kNoShortcut },
+  { ngx_string("Location"), ngx_string("location"), PS_SHORTCUT(location) },
+  { ngx_string("Server"), ngx_string("server"), PS_SHORTCUT(server) },
+  { ngx_string("Vary"), ngx_string("vary"), kNoShortcut },
+};
+
+#undef PS_SHORTCUT
+
+// Perfect hash table over known_headers.  KnownHeaderSlot() has no collisions
+// for the names above; InitKnownHeaders() checks this, so if you add a name
+// and it fires, adjust the function.
+const size_t kKnownHeaderSlots = 32;
+NgxKnownHeader* known_header_table[kKnownHeaderSlots];
+bool known_headers_initialized = false;
+
+size_t KnownHeaderSlot(StringPiece name) {
+  return (name.size() +
+          ngx_tolower(name[0]) +
+          ngx_tolower(name[name.size() - 1])) % kKnownHeaderSlots;
+}
+
+// Only called on the nginx worker thread.
+void InitKnownHeaders() {
+  for (size_t i = 0; i < arraysize(known_headers); ++i) {
+    NgxKnownHeader* header = &known_headers[i];
+    header->hash = ngx_hash_key(header->lowcase_name.data,
+                                header->lowcase_name.len);
+    size_t slot = KnownHeaderSlot(ngx_psol::str_to_string_piece(header->name));
+    CHECK(known_header_table[slot] == NULL) << "known header collision";
+    known_header_table[slot] = header;
+  }
+  known_headers_initialized = true;
+}
+
+const NgxKnownHeader* LookupKnownHeader(StringPiece name) {
+  if (!known_headers_initialized) {
+    InitKnownHeaders();
+  }
+  if (name.empty()) {
+    return NULL;
+  }
+  const NgxKnownHeader* header = known_header_table[KnownHeaderSlot(name)];
+  if (header == NULL ||
+      header->name.len != name.size() ||
+      ngx_strncasecmp(header->name.data,
+                      reinterpret_cast<u_char*>(const_cast<char*>(name.data())),
+                      name.size()) != 0) {
+    return NULL;
+  }
+  return header;
+}
+
+}  // namespace
+
+const char NgxBaseFetch::kFetchWakeups[] = "ngx_pagespeed_fetch_wakeups";
+const char NgxBaseFetch::kFetchResponses[] = "ngx_pagespeed_fetch_responses";
+
+NgxBaseFetch::NgxBaseFetch(ngx_http_request_t* r, NgxFetchQueue* queue)
+    : request_(r),
+      last_buf_sent_(false),
+      current_segment_(NULL),
+      segment_size_(kDefaultSegmentSize),
+      max_buffered_bytes_(0),
+      max_worker_buffered_bytes_(0),
+      max_spill_bytes_(0),
+      queue_(queue),
+      next_segment_size_(kMinSegmentSize),
+      spill_fd_(NGX_INVALID_FILE),
+      spill_size_(0),
+      allocated_bytes_(0),
+      failed_(0),
+      done_called_(0),
+      released_(0),
+      collection_requested_(0),
+      wakeups_(0),
+      references_(1) {
+  ngx_http_core_loc_conf_t* clcf = static_cast<ngx_http_core_loc_conf_t*>(
+      ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+  ngx_psol::str_to_string_piece(clcf->client_body_temp_path->name).CopyToString(
+      &spill_dir_);
 }
 
 NgxBaseFetch::~NgxBaseFetch() {
-  pthread_mutex_destroy(&mutex_);
+  // Both sides are done with us, so we can look at everything.
+  if (current_segment_ != NULL) {
+    DeleteSegment(current_segment_);
+  }
+  DeleteSegments(&sent_segments_);
+  DeleteSegments(&published_segments_);
+  DeleteSegments(&free_segments_);
+  if (spill_fd_ != NGX_INVALID_FILE) {
+    close(spill_fd_);
+  }
+}
+
+void NgxBaseFetch::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kFetchWakeups);
+  statistics->AddVariable(kFetchResponses);
 }
 
-void NgxBaseFetch::Lock() {
-  pthread_mutex_lock(&mutex_);
+void NgxBaseFetch::IncrementRefCount() {
+  __sync_add_and_fetch(&references_, 1);
 }
 
-void NgxBaseFetch::Unlock() {
-  pthread_mutex_unlock(&mutex_);
+void NgxBaseFetch::DecrefAndDeleteIfUnreferenced() {
+  if (__sync_add_and_fetch(&references_, -1) == 0) {
+    delete this;
+  }
+}
+
+void NgxBaseFetch::Release() {
+  // The nginx buffers pointing at these segments came out of the request pool,
+  // which is about to go away.
+  DeleteSegments(&sent_segments_);
+  request_ = NULL;
+
+  // Nobody is going to send our output now, so HandleWrite() can drop it.
+  __sync_fetch_and_or(&released_, 1);
+
+  DecrefAndDeleteIfUnreferenced();
 }
 
 void NgxBaseFetch::PopulateRequestHeaders() {
-  CopyHeadersFromTable<RequestHeaders>(&request_->headers_in.headers,
+  CopyHeadersFromTable<RequestHeaders>(request_, &request_->headers_in.headers,
                                        request_headers());
 }
 
 void NgxBaseFetch::PopulateResponseHeaders() {
-  CopyHeadersFromTable<ResponseHeaders>(&request_->headers_out.headers,
-                                        response_headers());
+  CopyResponseHeaders(request_, response_headers());
+}
 
-  response_headers()->set_status_code(request_->headers_out.status);
+void NgxBaseFetch::CopyResponseHeaders(ngx_http_request_t* r,
+                                       ResponseHeaders* headers) {
+  CopyHeadersFromTable<ResponseHeaders>(r, &r->headers_out.headers, headers);
+
+  headers->set_status_code(r->headers_out.status);
 
   // Manually copy over the content type because it's not included in
-  // request_->headers_out.headers.
-  response_headers()->Add(
-      HttpAttributes::kContentType,
-      ngx_psol::str_to_string_piece(request_->headers_out.content_type));
+  // r->headers_out.headers.
+  headers->Add(HttpAttributes::kContentType,
+               ngx_psol::str_to_string_piece(r->headers_out.content_type));
 
   // TODO(oschaaf): ComputeCaching should be called in setupforhtml()?
-  response_headers()->ComputeCaching();
+  headers->ComputeCaching();
 }
 
 template<class HeadersT>
-void NgxBaseFetch::CopyHeadersFromTable(ngx_list_t* headers_from,
+void NgxBaseFetch::CopyHeadersFromTable(ngx_http_request_t* r,
+                                        ngx_list_t* headers_from,
                                         HeadersT* headers_to) {
   // http_version is the version number of protocol; 1.1 = 1001. See
   // NGX_HTTP_VERSION_* in ngx_http_request.h
-  headers_to->set_major_version(request_->http_version / 1000);
-  headers_to->set_minor_version(request_->http_version % 1000);
+  headers_to->set_major_version(r->http_version / 1000);
+  headers_to->set_minor_version(r->http_version % 1000);
 
   // Standard nginx idiom for iterating over a list.  See ngx_list.h
   ngx_uint_t i;
@@ -88,6 +249,11 @@ void NgxBaseFetch::CopyHeadersFromTable(ngx_list_t* headers_from,
       i = 0;
     }
 
+    if (header[i].hash == 0) {
+      // Removed by a module, like the Content-Encoding of html we inflate.
+      continue;
+    }
+
     StringPiece key = ngx_psol::str_to_string_piece(header[i].key);
     StringPiece value = ngx_psol::str_to_string_piece(header[i].value);
 
@@ -95,29 +261,294 @@ void NgxBaseFetch::CopyHeadersFromTable(ngx_list_t* headers_from,
   }
 }
 
+bool NgxBaseFetch::OverMemoryLimits(int64 more_bytes) {
+  return ((max_buffered_bytes_ > 0 &&
+           __sync_fetch_and_add(&allocated_bytes_, 0) + more_bytes >
+           max_buffered_bytes_) ||
+          (max_worker_buffered_bytes_ > 0 &&
+           __sync_fetch_and_add(&worker_segment_bytes, 0) + more_bytes >
+           max_worker_buffered_bytes_));
+}
+
+void NgxBaseFetch::DeleteSegment(NgxOutputSegment* segment) {
+  if (segment->end != segment->start) {
+    int64 size = segment->end - segment->start;
+    __sync_sub_and_fetch(&allocated_bytes_, size);
+    __sync_sub_and_fetch(&worker_segment_bytes, size);
+  }
+  delete [] segment->start;
+  delete segment;
+}
+
+void NgxBaseFetch::DeleteSegments(std::vector<NgxOutputSegment*>* segments) {
+  for (size_t i = 0; i < segments->size(); ++i) {
+    DeleteSegment((*segments)[i]);
+  }
+  segments->clear();
+}
+
+void NgxBaseFetch::DeleteSegments(NgxSpscQueue<NgxOutputSegment*>* segments) {
+  NgxOutputSegment* segment;
+  while (segments->Pop(&segment)) {
+    DeleteSegment(segment);
+  }
+}
+
+NgxOutputSegment* NgxBaseFetch::NewSegment(size_t wanted, bool force) {
+  NgxOutputSegment* segment;
+  if (!free_segments_.Pop(&segment)) {
+    // Enough for this write, but at least double the last segment so a long
+    // flush window still goes out as a few large buffers.
+    size_t size = std::min(segment_size_,
+                           std::max(next_segment_size_, wanted));
+    if (!force && OverMemoryLimits(size)) {
+      return NULL;
+    }
+    next_segment_size_ = std::min(segment_size_, 2 * size);
+    __sync_add_and_fetch(&allocated_bytes_, static_cast<int64>(size));
+    __sync_add_and_fetch(&worker_segment_bytes, static_cast<int64>(size));
+    segment = new NgxOutputSegment;
+    segment->start = new u_char[size];
+    segment->end = segment->start + size;
+    segment->in_file = false;
+    segment->fd = NGX_INVALID_FILE;
+    segment->file_start = segment->file_last = 0;
+  }
+  segment->last = segment->start;
+  segment->buf = NULL;
+  return segment;
+}
+
+NgxOutputSegment* NgxBaseFetch::NewFileSegment(MessageHandler* handler) {
+  if (spill_fd_ == NGX_INVALID_FILE) {
+    GoogleString path = StrCat(spill_dir_, "/pagespeed_spill_XXXXXX");
+    spill_fd_ = mkstemp(&path[0]);
+    if (spill_fd_ == NGX_INVALID_FILE) {
+      handler->Message(kWarning, "Couldn't create output spill file in %s",
+                       spill_dir_.c_str());
+      return NULL;
+    }
+    // Nothing but our fd needs the file, so it goes away when we close it.
+    unlink(path.c_str());
+  }
+
+  NgxOutputSegment* segment = new NgxOutputSegment;
+  segment->start = segment->last = segment->end = NULL;
+  segment->in_file = true;
+  segment->fd = spill_fd_;
+  segment->file_start = segment->file_last = spill_size_;
+  segment->buf = NULL;
+  return segment;
+}
+
+bool NgxBaseFetch::Spill(const char* data, size_t size,
+                         MessageHandler* handler) {
+  off_t offset = spill_size_;
+  while (size > 0) {
+    ssize_t n = pwrite(spill_fd_, data, size, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      handler->Message(kWarning, "Couldn't write output spill file in %s",
+                       spill_dir_.c_str());
+      return false;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  spill_size_ = offset;
+  current_segment_->file_last = offset;
+  if (current_segment_->file_last - current_segment_->file_start >=
+      static_cast<off_t>(segment_size_)) {
+    PublishCurrentSegment();
+  }
+  return true;
+}
+
+void NgxBaseFetch::PublishCurrentSegment() {
+  if (current_segment_ != NULL) {
+    published_segments_.Push(current_segment_);
+    current_segment_ = NULL;
+  }
+}
+
+void NgxBaseFetch::RecycleSentSegments() {
+  // Once the rewrite thread is done it won't want them back.
+  bool done = __sync_fetch_and_add(&done_called_, 0) != 0;
+  size_t kept = 0;
+  for (size_t i = 0; i < sent_segments_.size(); ++i) {
+    NgxOutputSegment* segment = sent_segments_[i];
+    if (ngx_buf_size(segment->buf) != 0) {
+      // nginx still has data from this segment to send.
+      sent_segments_[kept++] = segment;
+      continue;
+    }
+
+    if (segment->in_file || done || OverMemoryLimits(0)) {
+      DeleteSegment(segment);
+    } else {
+      free_segments_.Push(segment);
+    }
+  }
+  sent_segments_.resize(kept);
+}
+
 bool NgxBaseFetch::HandleWrite(const StringPiece& sp,
                                MessageHandler* handler) {
-  Lock();
-  buffer_.append(sp.data(), sp.size());
-  Unlock();
+  if (__sync_fetch_and_add(&released_, 0) != 0) {
+    // nginx is done with the request, so nobody will read this.
+    return true;
+  }
+  if (__sync_fetch_and_add(&failed_, 0) != 0) {
+    return false;
+  }
+
+  const char* data = sp.data();
+  size_t remaining = sp.size();
+
+  while (remaining > 0) {
+    if (current_segment_ == NULL || current_segment_->in_file) {
+      // Write to memory whenever we're under our limits, which includes when
+      // nginx has sent enough of what we spilled to give segments back.
+      NgxOutputSegment* segment = NewSegment(remaining, false);
+      if (segment == NULL) {
+        // Over our limits, usually because of slow clients.  Rather than hold
+        // up this thread, which other requests share, until nginx has sent
+        // some of our output, append to the spill file.
+        if (max_spill_bytes_ > 0 &&
+            spill_size_ + static_cast<int64>(remaining) > max_spill_bytes_) {
+          // The client isn't keeping up with a response this big.  Give up on
+          // it rather than fill the disk.
+          handler->Message(
+              kWarning, "Output spill file in %s would pass %ld bytes",
+              spill_dir_.c_str(), static_cast<long>(max_spill_bytes_));
+          __sync_fetch_and_or(&failed_, 1);
+          RequestCollection();
+          return false;
+        }
+        if (current_segment_ == NULL) {
+          current_segment_ = NewFileSegment(handler);
+        }
+        if (current_segment_ != NULL && Spill(data, remaining, handler)) {
+          return true;
+        }
+        // Can't spill, so go over the limits rather than fail the response.
+        segment = NewSegment(remaining, true);
+      }
+      if (current_segment_ != NULL &&
+          current_segment_->file_last == current_segment_->file_start) {
+        // An empty file segment from a failed spill.
+        DeleteSegment(current_segment_);
+        current_segment_ = NULL;
+      }
+      PublishCurrentSegment();
+      current_segment_ = segment;
+    }
+
+    size_t size = current_segment_->end - current_segment_->last;
+    if (size > remaining) {
+      size = remaining;
+    }
+    ngx_memcpy(current_segment_->last, data, size);
+    current_segment_->last += size;
+    data += size;
+    remaining -= size;
+
+    if (current_segment_->last == current_segment_->end) {
+      PublishCurrentSegment();
+    }
+  }
   return true;
 }
 
 ngx_int_t NgxBaseFetch::CopyBufferToNginx(ngx_chain_t** link_ptr) {
-  if (done_called_ && last_buf_sent_) {
+  if (last_buf_sent_) {
     return NGX_DECLINED;
   }
 
-  int rc = ngx_psol::string_piece_to_buffer_chain(
-      request_->pool, buffer_, link_ptr, done_called_ /* send_last_buf */);
-  if (rc != NGX_OK) {
-    return rc;
+  if (__sync_fetch_and_add(&failed_, 0) != 0) {
+    return NGX_ERROR;
   }
 
-  // Done with buffer contents now.
-  buffer_.clear();
+  RecycleSentSegments();
+
+  // Read done before taking segments: the rewrite thread publishes its last
+  // segment before setting done, so if we see done we'll see every segment.
+  bool done = __sync_fetch_and_add(&done_called_, 0) != 0;
+
+  *link_ptr = NULL;
+  ngx_chain_t** next_link_ptr = link_ptr;
+  ngx_chain_t* tail_link = NULL;
+
+  while (true) {
+    NgxOutputSegment* segment = NULL;
+    if (!published_segments_.Pop(&segment) &&
+        (!done || tail_link != NULL)) {
+      break;
+    }
+
+    ngx_buf_t* b = static_cast<ngx_buf_t*>(ngx_calloc_buf(request_->pool));
+    if (b == NULL) {
+      if (segment != NULL) {
+        // Keep it around so it gets cleaned up.
+        sent_segments_.push_back(segment);
+      }
+      return NGX_ERROR;
+    }
+
+    if (segment != NULL && segment->in_file) {
+      // A range of the spill file, which nginx reads or sendfile()s itself.
+      b->file = static_cast<ngx_file_t*>(
+          ngx_pcalloc(request_->pool, sizeof(ngx_file_t)));
+      if (b->file == NULL) {
+        sent_segments_.push_back(segment);
+        return NGX_ERROR;
+      }
+      b->file->fd = segment->fd;
+      b->file->name = spill_file_name;
+      b->file->log = request_->connection->log;
+      b->in_file = 1;
+      b->file_pos = segment->file_start;
+      b->file_last = segment->file_last;
+      segment->buf = b;
+      sent_segments_.push_back(segment);
+    } else if (segment != NULL) {
+      // Point nginx directly at the segment memory instead of copying it.
+      // nginx owns it until it has sent it.
+      b->start = b->pos = segment->start;
+      b->last = b->end = segment->last;
+      b->temporary = 1;  // Identify this buffer as in-memory and mutable.
+      segment->buf = b;
+      sent_segments_.push_back(segment);
+    } else {
+      // Done() with nothing buffered.  The purpose of this buffer is just to
+      // pass along last_buf.
+      b->pos = b->start = b->end = b->last = NULL;
+      b->sync = 1;
+    }
+
+    ngx_chain_t* cl = static_cast<ngx_chain_t*>(
+        ngx_alloc_chain_link(request_->pool));
+    if (cl == NULL) {
+      return NGX_ERROR;
+    }
+    cl->buf = b;
+    cl->next = NULL;
+
+    *next_link_ptr = cl;
+    next_link_ptr = &cl->next;
+    tail_link = cl;
+  }
 
-  if (done_called_) {
+  if (tail_link == NULL) {
+    // Nothing to send, not even the metadata that this is the last buffer.
+    return NGX_DECLINED;
+  }
+
+  if (done) {
+    tail_link->buf->last_buf = true;
     last_buf_sent_ = true;
   }
 
@@ -128,9 +559,7 @@ ngx_int_t NgxBaseFetch::CopyBufferToNginx(ngx_chain_t** link_ptr) {
 // and Done() such that we're sending an empty buffer with last_buf set, which I
 // think nginx will reject.
 ngx_int_t NgxBaseFetch::CollectAccumulatedWrites(ngx_chain_t** link_ptr) {
-  Lock();
   ngx_int_t rc = CopyBufferToNginx(link_ptr);
-  Unlock();
 
   if (rc == NGX_DECLINED) {
     *link_ptr = NULL;
@@ -140,24 +569,44 @@ ngx_int_t NgxBaseFetch::CollectAccumulatedWrites(ngx_chain_t** link_ptr) {
 }
 
 ngx_int_t NgxBaseFetch::CollectHeaders(ngx_http_headers_out_t* headers_out) {
-  // Copy from response_headers() into headers_out.
+  // Copy from response_headers() into headers_out.  The rewrite thread is done
+  // with them once it has called HeadersComplete(), which happens before the
+  // notification that got us here.  headers_out is always request_'s.
+  return CopyHeadersToRequest(*response_headers(), request_);
+}
 
-  Lock();
-  const ResponseHeaders* pagespeed_headers = response_headers();
-  Unlock();
+ngx_int_t NgxBaseFetch::CopyHeadersToRequest(const ResponseHeaders& headers,
+                                             ngx_http_request_t* r) {
+  const ResponseHeaders* pagespeed_headers = &headers;
+  ngx_http_headers_out_t* headers_out = &r->headers_out;
 
   headers_out->status = pagespeed_headers->status_code();
 
-  ngx_int_t i;
-  for (i = 0 ; i < pagespeed_headers->NumAttributes() ; i++) {
+  // Copy all the values, and any names we don't have interned, into a single
+  // pool allocation instead of one per string.
+  int n = pagespeed_headers->NumAttributes();
+  size_t copy_size = 0;
+  int i;
+  for (i = 0 ; i < n ; i++) {
+    copy_size += pagespeed_headers->Value(i).size();
+    if (LookupKnownHeader(pagespeed_headers->Name(i)) == NULL) {
+      // Space for both the name and its lowercase version.
+      copy_size += 2 * pagespeed_headers->Name(i).size();
+    }
+  }
+
+  u_char* copy = NULL;
+  if (copy_size > 0) {
+    copy = static_cast<u_char*>(ngx_pnalloc(r->pool, copy_size));
+    if (copy == NULL) {
+      return NGX_ERROR;
+    }
+  }
+
+  for (i = 0 ; i < n ; i++) {
     const GoogleString& name_gs = pagespeed_headers->Name(i);
     const GoogleString& value_gs = pagespeed_headers->Value(i);
-
-    ngx_str_t name, value;
-    name.len = name_gs.length();
-    name.data = reinterpret_cast<u_char*>(const_cast<char*>(name_gs.data()));
-    value.len = value_gs.length();
-    value.data = reinterpret_cast<u_char*>(const_cast<char*>(value_gs.data()));
+    const NgxKnownHeader* known = LookupKnownHeader(name_gs);
 
     // TODO(jefftk): If we're setting a cache control header we'd like to
     // prevent any downstream code from changing it.  Specifically, if we're
@@ -167,17 +616,14 @@ ngx_int_t NgxBaseFetch::CollectHeaders(ngx_http_headers_out_t* headers_out) {
     // shouldn't apply to our generated resources.  See Apache code in
     // net/instaweb/apache/header_util:AddResponseHeadersToRequest
 
-    // Make copies of name and value to put into headers_out.
+    ngx_str_t value;
+    value.len = value_gs.size();
+    value.data = copy;
+    copy = ngx_cpymem(copy, value_gs.data(), value.len);
 
-    u_char* value_s = ngx_pstrdup(request_->pool, &value);
-    if (value_s == NULL) {
-      return NGX_ERROR;
-    }
-
-    if (STR_EQ_LITERAL(name, "Content-Type")) {
+    if (known != NULL && known->shortcut_offset == kContentTypeShortcut) {
       // Unlike all the other headers, content_type is just a string.
-      headers_out->content_type.data = value_s;
-      headers_out->content_type.len = value.len;
+      headers_out->content_type = value;
       headers_out->content_type_len = value.len;
       // In ngx_http_test_content_type() nginx will allocate and calculate
       // content_type_lowcase if we leave it as null.
@@ -185,36 +631,36 @@ ngx_int_t NgxBaseFetch::CollectHeaders(ngx_http_headers_out_t* headers_out) {
       continue;
     }
 
-    u_char* name_s = ngx_pstrdup(request_->pool, &name);
-    if (name_s == NULL) {
-      return NGX_ERROR;
-    }
-
     ngx_table_elt_t* header = static_cast<ngx_table_elt_t*>(
         ngx_list_push(&headers_out->headers));
     if (header == NULL) {
       return NGX_ERROR;
     }
 
-    header->hash = 1;  // Include this header in the output.
-    header->key.len = name.len;
-    header->key.data = name_s;
-    header->value.len = value.len;
-    header->value.data = value_s;
+    if (known != NULL) {
+      header->key = known->name;
+      header->lowcase_key = known->lowcase_name.data;
+      header->hash = known->hash;
+    } else {
+      header->key.len = name_gs.size();
+      header->key.data = copy;
+      copy = ngx_cpymem(copy, name_gs.data(), header->key.len);
+
+      header->lowcase_key = copy;
+      ngx_strlow(header->lowcase_key, header->key.data, header->key.len);
+      copy += header->key.len;
+      header->hash = ngx_hash_key(header->lowcase_key, header->key.len);
+    }
+    header->value = value;
 
     // Populate the shortcuts to commonly used headers.
-    if (STR_EQ_LITERAL(name, "Date")) {
-      headers_out->date = header;
-    } else if (STR_EQ_LITERAL(name, "Etag")) {
-      headers_out->etag = header;
-    } else if (STR_EQ_LITERAL(name, "Expires")) {
-      headers_out->expires = header;
-    } else if (STR_EQ_LITERAL(name, "Last-Modified")) {
-      headers_out->last_modified = header;
-    } else if (STR_EQ_LITERAL(name, "Location")) {
-      headers_out->location = header;
-    } else if (STR_EQ_LITERAL(name, "Server")) {
-      headers_out->server = header;
+    if (known != NULL && known->shortcut_offset >= 0) {
+      *reinterpret_cast<ngx_table_elt_t**>(
+          reinterpret_cast<char*>(headers_out) + known->shortcut_offset) =
+          header;
+      if (header == headers_out->content_length) {
+        headers_out->content_length_n = ngx_atoof(value.data, value.len);
+      }
     }
   }
 
@@ -222,41 +668,41 @@ ngx_int_t NgxBaseFetch::CollectHeaders(ngx_http_headers_out_t* headers_out) {
 }
 
 void NgxBaseFetch::RequestCollection() {
-  int rc;
-  char c = 'A';  // What byte we write is arbitrary.
-  while (true) {
-    rc = write(pipe_fd_, &c, 1);
-    if (rc == 1) {
-      break;
-    } else if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-      // TODO(jefftk): is this rare enough that spinning isn't a problem?  Could
-      // we get into a case where the pipe fills up and we spin forever?
-
-    } else {
-      perror("NgxBaseFetch::RequestCollection");
-      break;
-    }
+  // If a notification is already queued nginx will pick up whatever we've
+  // published since when it gets to it.
+  if (__sync_bool_compare_and_swap(&collection_requested_, 0, 1)) {
+    __sync_add_and_fetch(&wakeups_, 1);
+    queue_->Notify(this);
   }
 }
 
+void NgxBaseFetch::ClearCollectionRequest() {
+  // Full barrier: anything published after this is either seen by the
+  // collection that follows or sends a new notification.
+  __sync_fetch_and_and(&collection_requested_, 0);
+}
+
 void NgxBaseFetch::HandleHeadersComplete() {
   RequestCollection();  // Headers available.
 }
 
 bool NgxBaseFetch::HandleFlush(MessageHandler* handler) {
+  PublishCurrentSegment();
+  // The next flush window may be just as small.
+  next_segment_size_ = kMinSegmentSize;
   RequestCollection();  // A new part of the response body is available.
   return true;
 }
 
 void NgxBaseFetch::HandleDone(bool success) {
-  // TODO(jefftk): it's possible that instead of locking here we can just modify
-  // CopyBufferToNginx to only read done_called_ once.
-  Lock();
-  done_called_ = true;
-  Unlock();
-
-  close(pipe_fd_);  // Indicates to nginx that we're done with the rewrite.
-  pipe_fd_ = -1;
+  PublishCurrentSegment();
+  // Full barrier: the segment is visible before done is.
+  __sync_fetch_and_or(&done_called_, 1);
+
+  RequestCollection();  // Tells nginx to make a final collection.
+
+  // Pagespeed is done with us.  This may delete this.
+  DecrefAndDeleteIfUnreferenced();
 }
 
 }  // namespace net_instaweb
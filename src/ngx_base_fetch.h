@@ -17,43 +17,140 @@
 // Author: jefftk@google.com (Jeff Kaufman)
 //
 // Collects output from pagespeed and buffers it until nginx asks for it.
-// Notifies nginx via pipe to call CollectAccumulatedWrites() on flush.
+// Notifies nginx via the worker's NgxFetchQueue to call
+// CollectAccumulatedWrites() on flush.
 //
 //  - nginx creates a base fetch and passes it to a new proxy fetch.
 //  - The proxy fetch manages rewriting and thread complexity, and through
 //    several chained steps passes rewritten html to HandleWrite().
-//  - Written data is buffered.
-//  - When Flush() is called the base fetch writes a byte to a pipe nginx is
-//    watching so nginx knows to call CollectAccumulatedWrites() to pick up the
-//    rewritten html.
-//  - When Done() is called the base fetch closes the pipe, which tells nginx to
-//    make a final call to CollectAccumulatedWrites().
+//  - Written data is buffered in output segments.  Segments are handed to
+//    nginx as-is, without copying, and are reused for later writes once nginx
+//    has sent them.  After a flush segments start small and double up to
+//    segment_size, so a flush of a few bytes doesn't tie up a whole segment.
+//  - When Flush() is called the base fetch publishes the segment it was
+//    filling and queues itself on the fetch queue so nginx knows to call
+//    CollectAccumulatedWrites() to pick up the rewritten html.
+//  - When Done() is called the base fetch queues itself a final time, and
+//    nginx's last call to CollectAccumulatedWrites() sets last_buf.
+//  - At most one notification is outstanding per fetch: once queued, further
+//    flushes just add data until nginx calls ClearCollectionRequest() and
+//    collects everything pending.
+//  - Segment memory is limited per request by max_buffered_bytes and per
+//    worker by max_worker_buffered_bytes.  Sent segments only wait for reuse
+//    while we're under both limits; otherwise they're freed.  Past either
+//    limit, usually because clients are slow, HandleWrite() appends to a temp
+//    file instead and nginx sends that part of the response from the file.
+//    The thread calling HandleWrite() is often shared with other requests, so
+//    it never waits on nginx; creating and appending to the temp file only
+//    waits on the local disk.  The file is limited by max_spill_bytes, past
+//    which the response fails.
+//
+// There is exactly one producer (whichever rewrite thread is calling the
+// Handle* methods) and one consumer (the nginx worker), so segments move
+// between them through a pair of wait-free single-producer single-consumer
+// queues and neither side ever takes a lock.
+//
+// The base fetch is reference counted: nginx holds a reference until the
+// request is finished, pagespeed holds one until Done(), and the fetch queue
+// holds one per queued notification.
 
 #ifndef NGX_BASE_FETCH_H_
 #define NGX_BASE_FETCH_H_
 
 extern "C" {
-#include <pthread.h>
 #include <ngx_http.h>
 }
 
+#include <vector>
+
+#include "ngx_fetch_queue.h"
+#include "ngx_spsc_queue.h"
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/http/public/headers.h"
 #include "net/instaweb/util/public/string.h"
 
 namespace net_instaweb {
 
+class Statistics;
+
+// A block of memory that rewritten output is written into, or a
+// range of the spill file.  While nginx is sending the data, buf points to the
+// nginx buffer wrapping it.
+struct NgxOutputSegment {
+  u_char* start;
+  u_char* last;  // End of the data written so far.
+  u_char* end;   // End of the allocated memory.
+  // Set for spill file ranges, which have no memory.
+  bool in_file;
+  ngx_fd_t fd;
+  off_t file_start;
+  off_t file_last;
+  ngx_buf_t* buf;
+};
+
 class NgxBaseFetch : public AsyncFetch {
  public:
-  NgxBaseFetch(ngx_http_request_t* r, int pipe_fd);
+  // Statistics: notifications sent to nginx and the responses they were for.
+  // kFetchWakeups / kFetchResponses is the average wakeups per response.
+  static const char kFetchWakeups[];
+  static const char kFetchResponses[];
+
+  NgxBaseFetch(ngx_http_request_t* r, NgxFetchQueue* queue);
   virtual ~NgxBaseFetch();
 
-  // Copies the request headers out of request_->headers_in->headers.
+  static void InitStats(Statistics* statistics);
+
+  // The request we're collecting output for, or NULL once nginx has called
+  // Release().  Only call from the nginx worker thread.
+  ngx_http_request_t* request() { return request_; }
+
+  // Whether CollectAccumulatedWrites() has handed nginx the last buffer.  Only
+  // call from the nginx worker thread.
+  bool last_buf_sent() const { return last_buf_sent_; }
+
+  // Called by nginx when it handles our notification, before collecting.  Any
+  // output after this will send a new notification.
+  void ClearCollectionRequest();
+
+  // How many notifications we've sent nginx.  Only exact once we're done.
+  int wakeups() const { return wakeups_; }
+
+  // Limits on segment memory, for this fetch and for all fetches in the
+  // worker, before HandleWrite() spills to a temp file.  0 means no limit.
+  // Set before handing this fetch to pagespeed.
+  void set_max_buffered_bytes(int64 x) { max_buffered_bytes_ = x; }
+  void set_max_worker_buffered_bytes(int64 x) {
+    max_worker_buffered_bytes_ = x;
+  }
+  // Limit on the temp file.  0 means no limit.
+  void set_max_spill_bytes(int64 x) { max_spill_bytes_ = x; }
+
+  // Largest output segment we hand to nginx.  Set before handing this fetch to
+  // pagespeed.
+  void set_segment_size(size_t x) { segment_size_ = x; }
+
+  // Take a reference before handing this fetch to pagespeed; HandleDone()
+  // releases it.  Also used by the fetch queue.
+  void IncrementRefCount();
+  void DecrefAndDeleteIfUnreferenced();
+
+  // Called by nginx when it's done with the request.  Forgets about the
+  // request and drops nginx's reference.  The fetch may live on until
+  // pagespeed and the fetch queue are done with it.
+  void Release();
+
+  // Copies the request headers out of request_->headers_in->headers.  Not done
+  // on construction so requests we turn away never pay for the copy; call
+  // before anything reads request_headers().
   void PopulateRequestHeaders();
 
   // Copies the response headers out of request_->headers_out->headers.
   void PopulateResponseHeaders();
 
+  // Copies r's response headers, status, and content type into headers.
+  static void CopyResponseHeaders(ngx_http_request_t* r,
+                                  ResponseHeaders* headers);
+
   // Puts a chain in link_ptr if we have any output data buffered.  Returns
   // NGX_OK on success, NGX_ERROR on errors.  If there's no data to send, sends
   // data only if Done() has been called.  Indicates the end of output by
@@ -70,6 +167,11 @@ class NgxBaseFetch : public AsyncFetch {
   // time for resource fetches.  Not called at all for proxy fetches.
   ngx_int_t CollectHeaders(ngx_http_headers_out_t* headers_out);
 
+  // Copies headers' status and attributes into r's response headers.  Returns
+  // NGX_OK on success, NGX_ERROR on errors.
+  static ngx_int_t CopyHeadersToRequest(const ResponseHeaders& headers,
+                                        ngx_http_request_t* r);
+
  private:
   virtual bool HandleWrite(const StringPiece& sp, MessageHandler* handler);
   virtual bool HandleFlush(MessageHandler* handler);
@@ -79,29 +181,95 @@ class NgxBaseFetch : public AsyncFetch {
   
   // Helper method for PopulateRequestHeaders and PopulateResponseHeaders.
   template<class HeadersT>
-  void CopyHeadersFromTable(ngx_list_t* headers_from, HeadersT* headers_to);
+  static void CopyHeadersFromTable(ngx_http_request_t* r,
+                                   ngx_list_t* headers_from,
+                                   HeadersT* headers_to);
 
   // Indicate to nginx that we would like it to call
-  // CollectAccumulatedWrites().
+  // CollectAccumulatedWrites(), unless we already have and it hasn't yet.
+  // Never blocks.
   void RequestCollection();
 
-  // Lock must be acquired first.
+  // Worker thread only.
   // Returns:
   //   NGX_DECLINED: nothing to send, short circuit.  Buffer not allocated.
   //   NGX_OK, NGX_ERROR: success, failure
-  // Allocates an nginx buffer, copies our buffer_ contents into it, clears
-  // buffer_.
+  // Wraps each published segment in an nginx buffer pointing directly at the
+  // segment memory and moves them over to sent_segments_.
   ngx_int_t CopyBufferToNginx(ngx_chain_t** link_ptr);
 
-  void Lock();
-  void Unlock();
+  // Rewrite thread only.  Returns a segment with room for more data, reusing
+  // one nginx has sent if there is one, or else allocating one sized for
+  // wanted bytes.  Returns NULL if a new one would put us over our memory
+  // limits, unless force.
+  NgxOutputSegment* NewSegment(size_t wanted, bool force);
+
+  // Rewrite thread only.  Returns a segment for data appended to the spill
+  // file, or NULL if we couldn't create the file.
+  NgxOutputSegment* NewFileSegment(MessageHandler* handler);
+
+  // Rewrite thread only.  Appends to the spill file and the current segment,
+  // which must be a file segment.
+  bool Spill(const char* data, size_t size, MessageHandler* handler);
+
+  // Whether segment memory is over our limits.
+  bool OverMemoryLimits(int64 more_bytes);
+
+  // Frees a segment and takes its memory off our counts.
+  void DeleteSegment(NgxOutputSegment* segment);
+  void DeleteSegments(std::vector<NgxOutputSegment*>* segments);
+  void DeleteSegments(NgxSpscQueue<NgxOutputSegment*>* segments);
 
+  // Rewrite thread only.  Hands the segment we're filling, if any, to nginx.
+  void PublishCurrentSegment();
+
+  // Worker thread only.  Returns segments nginx has finished sending to the
+  // rewrite thread for reuse, or frees them if the rewrite thread won't need
+  // them or we're over our memory limits.
+  void RecycleSentSegments();
+
+  // Only touched by the worker thread.
   ngx_http_request_t* request_;
-  GoogleString buffer_;
-  bool done_called_;
   bool last_buf_sent_;
-  int pipe_fd_;
-  pthread_mutex_t mutex_;
+  // Segments nginx has collected and may still be sending.
+  std::vector<NgxOutputSegment*> sent_segments_;
+
+  // Only touched by the rewrite thread.
+  NgxOutputSegment* current_segment_;
+
+  // Filled segments, rewrite thread to worker.
+  NgxSpscQueue<NgxOutputSegment*> published_segments_;
+  // Sent segments for reuse, worker to rewrite thread.
+  NgxSpscQueue<NgxOutputSegment*> free_segments_;
+
+  // Set before the fetch is handed to pagespeed and constant after.
+  size_t segment_size_;
+  int64 max_buffered_bytes_;
+  int64 max_worker_buffered_bytes_;
+  int64 max_spill_bytes_;
+  NgxFetchQueue* queue_;
+  // Where the spill file goes: the location's client_body_temp_path.
+  GoogleString spill_dir_;
+
+  // Only touched by the rewrite thread, until the destructor.
+  // Smallest segment NewSegment() will allocate next; reset by flushes.
+  size_t next_segment_size_;
+  ngx_fd_t spill_fd_;
+  off_t spill_size_;
+
+  // Shared; only accessed atomically.
+  // Memory allocated for our segments.
+  volatile int64 allocated_bytes_;
+  // Set by the rewrite thread if it couldn't take all of the output.
+  volatile int failed_;
+  // Set by the rewrite thread once its last segment is published.
+  volatile int done_called_;
+  // Set by the worker when nginx is done with the request.
+  volatile int released_;
+  // Set while a notification is queued that nginx hasn't handled yet.
+  volatile int collection_requested_;
+  volatile int wakeups_;
+  volatile int references_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxBaseFetch);
 };
@@ -0,0 +1,640 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_fetch.h"
+
+#include "ngx_url_async_fetcher.h"
+
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/http/public/meta_data.h"
+#include "net/instaweb/http/public/request_headers.h"
+#include "net/instaweb/http/public/response_headers.h"
+#include "net/instaweb/util/public/function.h"
+#include "net/instaweb/util/public/google_url.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Status line and headers have to fit in this; body data just cycles through.
+const size_t kResponseBufferSize = 16 * 1024;
+
+// Request headers that describe our connection to the client, not the one
+// we're making.
+const char* const kHopByHopHeaders[] = {
+  HttpAttributes::kConnection,
+  HttpAttributes::kContentLength,
+  HttpAttributes::kHost,
+  HttpAttributes::kTransferEncoding,
+  "Keep-Alive",
+  "Proxy-Connection",
+  "TE",
+  "Upgrade",
+};
+
+bool IsHopByHop(const StringPiece& name) {
+  for (size_t i = 0; i < arraysize(kHopByHopHeaders); ++i) {
+    if (StringCaseEqual(name, kHopByHopHeaders[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs one AsyncFetch callback off the event loop.  Holds nothing of the
+// NgxFetch, which may be gone by the time this runs.
+class FetchCallback : public Function {
+ public:
+  enum Type {
+    kHeadersComplete,
+    kWrite,
+    kDone,
+  };
+
+  FetchCallback(Type type, AsyncFetch* async_fetch, MessageHandler* handler)
+      : type_(type),
+        async_fetch_(async_fetch),
+        handler_(handler),
+        success_(false) {
+  }
+
+  GoogleString* mutable_data() { return &data_; }
+  void set_success(bool success) { success_ = success; }
+
+ protected:
+  virtual void Run() {
+    switch (type_) {
+      case kHeadersComplete:
+        async_fetch_->HeadersComplete();
+        break;
+      case kWrite:
+        async_fetch_->Write(data_, handler_);
+        break;
+      case kDone:
+        async_fetch_->Done(success_);
+        break;
+    }
+  }
+
+  // The pool is shutting down.  The fetch still has to finish.
+  virtual void Cancel() {
+    if (type_ == kDone) {
+      async_fetch_->Done(false);
+    }
+  }
+
+ private:
+  Type type_;
+  AsyncFetch* async_fetch_;
+  MessageHandler* handler_;
+  GoogleString data_;
+  bool success_;
+
+  DISALLOW_COPY_AND_ASSIGN(FetchCallback);
+};
+
+}  // namespace
+
+NgxFetch::NgxFetch(const GoogleString& url, AsyncFetch* async_fetch,
+                   MessageHandler* message_handler,
+                   NgxUrlAsyncFetcher* fetcher)
+    : url_(url),
+      async_fetch_(async_fetch),
+      message_handler_(message_handler),
+      fetcher_(fetcher),
+      callback_sequence_(NULL),
+      port_(0),
+      is_head_(false),
+      pool_(NULL),
+      log_(NULL),
+      request_(NULL),
+      out_(NULL),
+      in_(NULL),
+      resolver_ctx_(NULL),
+      connection_(NULL),
+      reused_connection_(false),
+      got_response_bytes_(false),
+      timed_out_(false),
+      parse_state_(kStatusLine),
+      chunked_body_(false),
+      body_remaining_(0),
+      keepalive_(false) {
+  ngx_memzero(&host_str_, sizeof(host_str_));
+  ngx_memzero(&status_, sizeof(status_));
+  ngx_memzero(&chunked_, sizeof(chunked_));
+  ngx_memzero(&sin_, sizeof(sin_));
+#if (NGX_HAVE_INET6)
+  ngx_memzero(&sin6_, sizeof(sin6_));
+#endif
+  ngx_memzero(&peer_, sizeof(peer_));
+  ngx_memzero(&timeout_event_, sizeof(timeout_event_));
+}
+
+NgxFetch::~NgxFetch() {
+  if (pool_ != NULL) {
+    ngx_destroy_pool(pool_);
+  }
+}
+
+void NgxFetch::Start() {
+  callback_sequence_ = fetcher_->NextCallbackSequence();
+  if (!Init()) {
+    Finish(false);
+    return;
+  }
+
+  timeout_event_.handler = TimeoutHandler;
+  timeout_event_.data = this;
+  timeout_event_.log = log_;
+  ngx_add_timer(&timeout_event_, fetcher_->timeout_ms());
+
+  ngx_connection_t* c = fetcher_->TakeIdleConnection(host_port_);
+  if (c != NULL) {
+    reused_connection_ = true;
+    UseConnection(c);
+    Write();
+    return;
+  }
+  Resolve();
+}
+
+void NgxFetch::Cancel() {
+  callback_sequence_ = fetcher_->NextCallbackSequence();
+  Finish(false);
+}
+
+bool NgxFetch::Init() {
+  log_ = fetcher_->log();
+  pool_ = ngx_create_pool(4096, log_);
+  if (pool_ == NULL) {
+    return false;
+  }
+
+  GoogleUrl url(url_);
+  if (!url.is_valid() || !url.SchemeIs("http")) {
+    message_handler_->Message(kError, "NgxFetch: can't fetch %s", url_.c_str());
+    return false;
+  }
+  host_ = url.Host().as_string();
+  // IPv6 literals come bracketed.
+  if (host_.size() > 2 && host_[0] == '[' && host_[host_.size() - 1] == ']') {
+    host_ = host_.substr(1, host_.size() - 2);
+  }
+  port_ = url.EffectiveIntPort();
+  host_port_ = StrCat(host_, ":", IntegerToString(port_));
+  host_str_.data = reinterpret_cast<u_char*>(const_cast<char*>(host_.data()));
+  host_str_.len = host_.size();
+
+  request_ = static_cast<ngx_http_request_t*>(
+      ngx_pcalloc(pool_, sizeof(ngx_http_request_t)));
+  in_ = ngx_create_temp_buf(pool_, kResponseBufferSize);
+  if (request_ == NULL || in_ == NULL) {
+    return false;
+  }
+
+  const RequestHeaders* request_headers = async_fetch_->request_headers();
+  is_head_ = (request_headers->method() == RequestHeaders::kHead);
+  GoogleString request = StrCat(
+      request_headers->method_string(), " ", url.PathAndLeaf(),
+      " HTTP/1.1\r\n");
+  StrAppend(&request, "Host: ", url.HostAndPort(), "\r\n");
+  for (int i = 0, n = request_headers->NumAttributes(); i < n; ++i) {
+    const GoogleString& name = request_headers->Name(i);
+    if (!IsHopByHop(name)) {
+      StrAppend(&request, name, ": ", request_headers->Value(i), "\r\n");
+    }
+  }
+  StrAppend(&request, "Connection: keep-alive\r\n\r\n");
+
+  out_ = ngx_create_temp_buf(pool_, request.size());
+  if (out_ == NULL) {
+    return false;
+  }
+  out_->last = ngx_cpymem(out_->pos, request.data(), request.size());
+  return true;
+}
+
+void NgxFetch::Resolve() {
+  in_addr_t addr = ngx_inet_addr(host_str_.data, host_str_.len);
+  if (addr != INADDR_NONE) {
+    sin_.sin_family = AF_INET;
+    sin_.sin_port = htons(port_);
+    sin_.sin_addr.s_addr = addr;
+    Connect(reinterpret_cast<struct sockaddr*>(&sin_), sizeof(sin_));
+    return;
+  }
+
+  if (host_.find(':') != GoogleString::npos) {
+#if (NGX_HAVE_INET6)
+    if (ngx_inet6_addr(host_str_.data, host_str_.len,
+                       sin6_.sin6_addr.s6_addr) == NGX_OK) {
+      sin6_.sin6_family = AF_INET6;
+      sin6_.sin6_port = htons(port_);
+      Connect(reinterpret_cast<struct sockaddr*>(&sin6_), sizeof(sin6_));
+      return;
+    }
+#endif
+    message_handler_->Message(
+        kWarning, "NgxFetch: nginx was built without IPv6 support, so "
+        "fetching %s with the fallback fetcher", url_.c_str());
+    FallBack();
+    return;
+  }
+
+  ngx_resolver_t* resolver = fetcher_->resolver();
+  if (resolver == NULL) {
+    message_handler_->Message(
+        kError, "NgxFetch: no FetcherResolver configured to look up %s",
+        host_.c_str());
+    Finish(false);
+    return;
+  }
+
+  resolver_ctx_ = ngx_resolve_start(resolver, NULL);
+  if (resolver_ctx_ == NULL || resolver_ctx_ == NGX_NO_RESOLVER) {
+    resolver_ctx_ = NULL;
+    Finish(false);
+    return;
+  }
+  resolver_ctx_->name = host_str_;
+  resolver_ctx_->type = NGX_RESOLVE_A;
+  resolver_ctx_->handler = ResolveDone;
+  resolver_ctx_->data = this;
+  resolver_ctx_->timeout = fetcher_->timeout_ms();
+
+  // This may call ResolveDone(), and so finish the fetch, before it returns.
+  if (ngx_resolve_name(resolver_ctx_) != NGX_OK) {
+    resolver_ctx_ = NULL;
+    Finish(false);
+  }
+}
+
+void NgxFetch::ResolveDone(ngx_resolver_ctx_t* resolver_ctx) {
+  NgxFetch* fetch = static_cast<NgxFetch*>(resolver_ctx->data);
+  fetch->resolver_ctx_ = NULL;
+
+  // nginx's resolver only asks for A records, so a host with just an IPv6
+  // address looks like it doesn't exist.
+  if (resolver_ctx->state == NGX_RESOLVE_NXDOMAIN ||
+      (resolver_ctx->state == NGX_OK && resolver_ctx->naddrs == 0)) {
+    fetch->message_handler_->Message(
+        kWarning, "NgxFetch: no IPv4 address for %s, so fetching %s with the "
+        "fallback fetcher", fetch->host_.c_str(), fetch->url_.c_str());
+    ngx_resolve_name_done(resolver_ctx);
+    fetch->FallBack();
+    return;
+  }
+  if (resolver_ctx->state != NGX_OK) {
+    fetch->message_handler_->Message(
+        kWarning, "NgxFetch: couldn't resolve %s: %s", fetch->host_.c_str(),
+        ngx_resolver_strerror(resolver_ctx->state));
+    ngx_resolve_name_done(resolver_ctx);
+    fetch->Finish(false);
+    return;
+  }
+
+  fetch->sin_.sin_family = AF_INET;
+  fetch->sin_.sin_port = htons(fetch->port_);
+  fetch->sin_.sin_addr.s_addr = resolver_ctx->addrs[0];
+  ngx_resolve_name_done(resolver_ctx);
+  fetch->Connect(reinterpret_cast<struct sockaddr*>(&fetch->sin_),
+                 sizeof(fetch->sin_));
+}
+
+void NgxFetch::Connect(struct sockaddr* sockaddr, socklen_t socklen) {
+  ngx_memzero(&peer_, sizeof(peer_));
+  peer_.sockaddr = sockaddr;
+  peer_.socklen = socklen;
+  peer_.name = &host_str_;
+  peer_.get = ngx_event_get_peer;
+  peer_.log = log_;
+  peer_.log_error = NGX_ERROR_ERR;
+  peer_.tries = 1;
+
+  ngx_int_t rc = ngx_event_connect_peer(&peer_);
+  if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+    if (peer_.connection != NULL) {
+      ngx_close_connection(peer_.connection);
+    }
+    message_handler_->Message(kWarning, "NgxFetch: couldn't connect to %s",
+                              host_port_.c_str());
+    Finish(false);
+    return;
+  }
+
+  UseConnection(peer_.connection);
+  if (rc == NGX_OK) {
+    Write();
+  }
+  // Otherwise we're still connecting, and WriteHandler() runs when we're done.
+}
+
+void NgxFetch::UseConnection(ngx_connection_t* c) {
+  connection_ = c;
+  c->data = this;
+  c->log = log_;
+  c->read->log = log_;
+  c->write->log = log_;
+  c->read->handler = ReadHandler;
+  c->write->handler = WriteHandler;
+  // nginx's parsers log through the request's connection.
+  request_->connection = c;
+}
+
+void NgxFetch::WriteHandler(ngx_event_t* ev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
+  NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+  fetch->Write();
+}
+
+void NgxFetch::ReadHandler(ngx_event_t* ev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
+  NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+  fetch->Read();
+}
+
+void NgxFetch::TimeoutHandler(ngx_event_t* ev) {
+  NgxFetch* fetch = static_cast<NgxFetch*>(ev->data);
+  fetch->message_handler_->Message(kWarning, "NgxFetch: timed out fetching %s",
+                                   fetch->url_.c_str());
+  fetch->timed_out_ = true;
+  fetch->Finish(false);
+}
+
+void NgxFetch::EmptyHandler(ngx_event_t* ev) {
+}
+
+void NgxFetch::Write() {
+  ngx_connection_t* c = connection_;
+  while (out_->pos < out_->last) {
+    ssize_t n = c->send(c, out_->pos, out_->last - out_->pos);
+    if (n == NGX_AGAIN) {
+      if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        Finish(false);
+      }
+      return;
+    }
+    if (n == NGX_ERROR) {
+      if (reused_connection_) {
+        RetryOnNewConnection();
+      } else {
+        Finish(false);
+      }
+      return;
+    }
+    out_->pos += n;
+  }
+
+  c->write->handler = EmptyHandler;
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    Finish(false);
+    return;
+  }
+  if (c->read->ready) {
+    Read();
+  }
+}
+
+void NgxFetch::Read() {
+  ngx_connection_t* c = connection_;
+  for (;;) {
+    if (parse_state_ == kBody && in_->pos == in_->last) {
+      in_->pos = in_->last = in_->start;
+    }
+    if (in_->last == in_->end) {
+      message_handler_->Message(
+          kWarning, "NgxFetch: response headers too large fetching %s",
+          url_.c_str());
+      Finish(false);
+      return;
+    }
+
+    ssize_t n = c->recv(c, in_->last, in_->end - in_->last);
+    if (n == NGX_AGAIN) {
+      if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        Finish(false);
+      }
+      return;
+    }
+    if (n == NGX_ERROR || n == 0) {
+      if (reused_connection_ && !got_response_bytes_) {
+        RetryOnNewConnection();
+      } else {
+        // Only a body that runs until the connection closes can end this way.
+        Finish(n == 0 && parse_state_ == kBody && body_remaining_ < 0);
+      }
+      return;
+    }
+
+    got_response_bytes_ = true;
+    in_->last += n;
+    ngx_int_t rc = Parse();
+    if (rc != NGX_AGAIN) {
+      Finish(rc == NGX_OK);
+      return;
+    }
+  }
+}
+
+ngx_int_t NgxFetch::Parse() {
+  if (parse_state_ == kStatusLine) {
+    ngx_int_t rc = ngx_http_parse_status_line(request_, in_, &status_);
+    if (rc == NGX_AGAIN) {
+      return NGX_AGAIN;
+    }
+    if (rc != NGX_OK) {
+      message_handler_->Message(kWarning, "NgxFetch: bad status line from %s",
+                                url_.c_str());
+      return NGX_ERROR;
+    }
+    ResponseHeaders* response_headers = async_fetch_->response_headers();
+    response_headers->set_major_version(status_.http_version / 1000);
+    response_headers->set_minor_version(status_.http_version % 1000);
+    response_headers->SetStatusAndReason(
+        static_cast<HttpStatus::Code>(status_.code));
+    parse_state_ = kHeaders;
+  }
+
+  if (parse_state_ == kHeaders) {
+    ResponseHeaders* response_headers = async_fetch_->response_headers();
+    for (;;) {
+      ngx_int_t rc = ngx_http_parse_header_line(request_, in_, 1);
+      if (rc == NGX_OK) {
+        response_headers->Add(
+            StringPiece(reinterpret_cast<char*>(request_->header_name_start),
+                        request_->header_name_end -
+                        request_->header_name_start),
+            StringPiece(reinterpret_cast<char*>(request_->header_start),
+                        request_->header_end - request_->header_start));
+      } else if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+      } else if (rc == NGX_HTTP_PARSE_HEADER_DONE) {
+        break;
+      } else {
+        message_handler_->Message(kWarning, "NgxFetch: bad header from %s",
+                                  url_.c_str());
+        return NGX_ERROR;
+      }
+    }
+    HandleHeaders();
+    parse_state_ = kBody;
+  }
+
+  return ParseBody();
+}
+
+void NgxFetch::HandleHeaders() {
+  ResponseHeaders* response_headers = async_fetch_->response_headers();
+  keepalive_ = (status_.http_version >= NGX_HTTP_VERSION_11 &&
+                !response_headers->HasValue(HttpAttributes::kConnection,
+                                            "close"));
+
+  int64 content_length;
+  int code = status_.code;
+  if (is_head_ || code == HttpStatus::kNoContent ||
+      code == HttpStatus::kNotModified || (code >= 100 && code < 200)) {
+    body_remaining_ = 0;
+  } else if (response_headers->HasValue(HttpAttributes::kTransferEncoding,
+                                        "chunked")) {
+    // We pass the body on unchunked.
+    chunked_body_ = true;
+    response_headers->RemoveAll(HttpAttributes::kTransferEncoding);
+  } else if (response_headers->FindContentLength(&content_length)) {
+    body_remaining_ = content_length;
+  } else {
+    body_remaining_ = -1;
+    keepalive_ = false;
+  }
+
+  response_headers->ComputeCaching();
+  RunCallback(new FetchCallback(FetchCallback::kHeadersComplete, async_fetch_,
+                                message_handler_));
+}
+
+ngx_int_t NgxFetch::ParseBody() {
+  if (chunked_body_) {
+    for (;;) {
+      ngx_int_t rc = ngx_http_parse_chunked(request_, in_, &chunked_);
+      if (rc == NGX_OK) {
+        // Some or all of a chunk's data is in the buffer.
+        size_t size = in_->last - in_->pos;
+        if (static_cast<off_t>(size) > chunked_.size) {
+          size = chunked_.size;
+        }
+        FetchCallback* callback = new FetchCallback(
+            FetchCallback::kWrite, async_fetch_, message_handler_);
+        callback->mutable_data()->assign(reinterpret_cast<char*>(in_->pos),
+                                         size);
+        RunCallback(callback);
+        in_->pos += size;
+        chunked_.size -= size;
+      } else if (rc == NGX_DONE) {
+        return NGX_OK;
+      } else if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+      } else {
+        message_handler_->Message(kWarning, "NgxFetch: bad chunk from %s",
+                                  url_.c_str());
+        return NGX_ERROR;
+      }
+    }
+  }
+
+  size_t size = in_->last - in_->pos;
+  if (body_remaining_ >= 0 && static_cast<int64>(size) > body_remaining_) {
+    size = body_remaining_;
+  }
+  if (size > 0) {
+    FetchCallback* callback = new FetchCallback(
+        FetchCallback::kWrite, async_fetch_, message_handler_);
+    callback->mutable_data()->assign(reinterpret_cast<char*>(in_->pos), size);
+    RunCallback(callback);
+    in_->pos += size;
+  }
+  if (body_remaining_ < 0) {
+    return NGX_AGAIN;  // Until the connection closes.
+  }
+  body_remaining_ -= size;
+  return (body_remaining_ == 0) ? NGX_OK : NGX_AGAIN;
+}
+
+void NgxFetch::RetryOnNewConnection() {
+  ngx_close_connection(connection_);
+  connection_ = NULL;
+  reused_connection_ = false;
+  out_->pos = out_->start;
+  in_->pos = in_->last = in_->start;
+  Resolve();
+}
+
+void NgxFetch::RunCallback(Function* callback) {
+  if (callback_sequence_ == NULL) {
+    callback->CallRun();
+  } else {
+    callback_sequence_->Add(callback);
+  }
+}
+
+void NgxFetch::Finish(bool success) {
+  // Anything left over means the server sent more than one response, and we
+  // can't use the connection for another request.
+  Release(success && keepalive_ && in_ != NULL && in_->pos == in_->last);
+
+  FetchCallback* callback = new FetchCallback(FetchCallback::kDone,
+                                              async_fetch_, message_handler_);
+  callback->set_success(success);
+  RunCallback(callback);
+  NgxUrlAsyncFetcher* fetcher = fetcher_;
+  bool timed_out = timed_out_;
+  delete this;
+  fetcher->FetchComplete(success, timed_out);
+}
+
+void NgxFetch::FallBack() {
+  UrlAsyncFetcher* fallback = fetcher_->fallback();
+  if (fallback == NULL) {
+    Finish(false);
+    return;
+  }
+  Release(false);
+  // Nothing has been sent to the AsyncFetch yet.
+  fallback->Fetch(url_, message_handler_, async_fetch_);
+  NgxUrlAsyncFetcher* fetcher = fetcher_;
+  delete this;
+  fetcher->FetchComplete(true, false);
+}
+
+void NgxFetch::Release(bool keep_connection) {
+  if (timeout_event_.timer_set) {
+    ngx_del_timer(&timeout_event_);
+  }
+  if (resolver_ctx_ != NULL) {
+    ngx_resolve_name_done(resolver_ctx_);
+    resolver_ctx_ = NULL;
+  }
+  if (connection_ != NULL) {
+    if (keep_connection) {
+      fetcher_->KeepIdleConnection(host_port_, connection_);
+    } else {
+      ngx_close_connection(connection_);
+    }
+    connection_ = NULL;
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// One http fetch for NgxUrlAsyncFetcher, run entirely on the worker's event
+// loop.
+//
+// The fetch resolves the host (or reuses an idle connection to it), connects,
+// sends a GET, and parses the response with nginx's own status line, header,
+// and chunked parsers.  Those want a request, so we keep a mostly empty one
+// around just for its parser state.  Body bytes are copied off to the
+// AsyncFetch as they arrive; its callbacks run on the fetcher's callback
+// threads, never on the event loop.  A single timer bounds the whole fetch.
+
+#ifndef NGX_FETCH_H_
+#define NGX_FETCH_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+#include <ngx_http.h>
+}
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/queued_worker_pool.h"
+#include "net/instaweb/util/public/string.h"
+
+namespace net_instaweb {
+
+class AsyncFetch;
+class Function;
+class MessageHandler;
+class NgxUrlAsyncFetcher;
+
+class NgxFetch {
+ public:
+  NgxFetch(const GoogleString& url, AsyncFetch* async_fetch,
+           MessageHandler* message_handler, NgxUrlAsyncFetcher* fetcher);
+  ~NgxFetch();
+
+  // Must be called on the worker.  When the fetch finishes this posts Done()
+  // for the AsyncFetch, calls FetchComplete() on the fetcher, and deletes
+  // itself.
+  void Start();
+
+  // Fails the fetch without starting it.
+  void Cancel();
+
+ private:
+  enum ParseState {
+    kStatusLine,
+    kHeaders,
+    kBody,
+  };
+
+  // Parses the url and builds the request.  Returns false if we can't fetch
+  // this url.
+  bool Init();
+
+  void Resolve();
+  static void ResolveDone(ngx_resolver_ctx_t* resolver_ctx);
+  void Connect(struct sockaddr* sockaddr, socklen_t socklen);
+  void UseConnection(ngx_connection_t* c);
+
+  static void WriteHandler(ngx_event_t* ev);
+  static void ReadHandler(ngx_event_t* ev);
+  static void TimeoutHandler(ngx_event_t* ev);
+  static void EmptyHandler(ngx_event_t* ev);
+  void Write();
+  void Read();
+
+  // Consume what's in the response buffer.  Return NGX_OK when the response
+  // is complete, NGX_AGAIN if we need more, or NGX_ERROR.
+  ngx_int_t Parse();
+  ngx_int_t ParseBody();
+  // Decides how the body is framed, then calls HeadersComplete().
+  void HandleHeaders();
+
+  // A reused connection can turn out to have been closed by the other end
+  // before it saw our request.  Start over on a new one.
+  void RetryOnNewConnection();
+
+  // Posts callback to this fetch's callback sequence.
+  void RunCallback(Function* callback);
+
+  // Closes what the fetch has open, posts Done(), and deletes the fetch.
+  void Finish(bool success);
+  // For a host we can't reach ourselves: closes what the fetch has open,
+  // hands the AsyncFetch to the fallback fetcher, and deletes the fetch.
+  void FallBack();
+  void Release(bool keep_connection);
+
+  GoogleString url_;
+  AsyncFetch* async_fetch_;
+  MessageHandler* message_handler_;
+  NgxUrlAsyncFetcher* fetcher_;
+  QueuedWorkerPool::Sequence* callback_sequence_;
+
+  GoogleString host_;
+  ngx_str_t host_str_;
+  int port_;
+  GoogleString host_port_;
+  bool is_head_;
+
+  ngx_pool_t* pool_;
+  ngx_log_t* log_;
+  // Only used for the state of nginx's response parsers.
+  ngx_http_request_t* request_;
+  ngx_http_status_t status_;
+  ngx_http_chunked_t chunked_;
+  ngx_buf_t* out_;
+  ngx_buf_t* in_;
+
+  ngx_resolver_ctx_t* resolver_ctx_;
+  struct sockaddr_in sin_;
+#if (NGX_HAVE_INET6)
+  struct sockaddr_in6 sin6_;
+#endif
+  ngx_peer_connection_t peer_;
+  ngx_connection_t* connection_;
+  ngx_event_t timeout_event_;
+  bool reused_connection_;
+  bool got_response_bytes_;
+  bool timed_out_;
+
+  ParseState parse_state_;
+  bool chunked_body_;
+  // Body bytes still to read when framed by content-length, or -1 if the
+  // body runs until the connection closes.
+  int64 body_remaining_;
+  bool keepalive_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxFetch);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_FETCH_H_
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_fetch_queue.h"
+
+#if (NGX_HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
+#include <unistd.h>
+
+#include "ngx_base_fetch.h"
+#include "base/logging.h"
+#include "net/instaweb/util/public/function.h"
+
+namespace net_instaweb {
+
+NgxFetchQueue::NgxFetchQueue(Handler handler)
+    : handler_(handler),
+      head_(NULL),
+      read_fd_(-1),
+      write_fd_(-1),
+      connection_(NULL),
+      worker_thread_(pthread_self()) {
+}
+
+NgxFetchQueue::~NgxFetchQueue() {
+  if (connection_ != NULL) {
+    ngx_close_connection(connection_);
+  } else if (read_fd_ != -1) {
+    close(read_fd_);
+  }
+  if (write_fd_ != -1 && write_fd_ != read_fd_) {
+    close(write_fd_);
+  }
+}
+
+ngx_int_t NgxFetchQueue::Init(ngx_log_t* log) {
+  worker_thread_ = pthread_self();
+
+#if (NGX_HAVE_EVENTFD)
+  read_fd_ = write_fd_ = eventfd(0, 0);
+  if (read_fd_ == -1) {
+    ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+    return NGX_ERROR;
+  }
+#else
+  int file_descriptors[2];
+  if (pipe(file_descriptors) != 0) {
+    ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "pipe() failed");
+    return NGX_ERROR;
+  }
+  read_fd_ = file_descriptors[0];
+  write_fd_ = file_descriptors[1];
+
+  if (ngx_nonblocking(write_fd_) == -1) {
+    ngx_log_error(NGX_LOG_EMERG, log, ngx_socket_errno,
+                  ngx_nonblocking_n " pipe[1] failed");
+    return NGX_ERROR;
+  }
+#endif
+
+  if (ngx_nonblocking(read_fd_) == -1) {
+    ngx_log_error(NGX_LOG_EMERG, log, ngx_socket_errno,
+                  ngx_nonblocking_n " pagespeed fetch queue failed");
+    return NGX_ERROR;
+  }
+
+  connection_ = ngx_get_connection(read_fd_, log);
+  if (connection_ == NULL) {
+    return NGX_ERROR;
+  }
+
+  connection_->recv = ngx_recv;
+  connection_->send = ngx_send;
+  connection_->recv_chain = ngx_recv_chain;
+  connection_->send_chain = ngx_send_chain;
+  connection_->read->log = log;
+  connection_->write->log = log;
+
+  // Tell nginx to monitor the fd and call us back when there's data.
+  connection_->data = this;
+  connection_->read->handler = ReadHandler;
+  return ngx_handle_read_event(connection_->read, 0);
+}
+
+void NgxFetchQueue::Notify(NgxBaseFetch* fetch) {
+  fetch->IncrementRefCount();  // Released in Drain().
+
+  Entry* entry = new Entry;
+  entry->fetch = fetch;
+  entry->task = NULL;
+  Push(entry);
+}
+
+void NgxFetchQueue::Run(Function* task) {
+  Entry* entry = new Entry;
+  entry->fetch = NULL;
+  entry->task = task;
+  Push(entry);
+}
+
+void NgxFetchQueue::Push(Entry* entry) {
+  Entry* old_head;
+  do {
+    old_head = head_;
+    entry->next = old_head;
+  } while (!__sync_bool_compare_and_swap(&head_, old_head, entry));
+
+  // If the list wasn't empty a wakeup is already on its way: the worker clears
+  // the fd before taking the list, so it will see this entry too.
+  if (old_head == NULL) {
+    Wakeup();
+  }
+}
+
+void NgxFetchQueue::Wakeup() {
+#if (NGX_HAVE_EVENTFD)
+  uint64_t value = 1;
+#else
+  char value = 'A';  // What byte we write is arbitrary.
+#endif
+  ssize_t rc;
+  do {
+    rc = write(write_fd_, &value, sizeof(value));
+  } while (rc == -1 && errno == EINTR);
+
+  // With a pipe, EAGAIN means it's already full and so already readable; the
+  // worker will wake up without another byte.
+  if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    perror("NgxFetchQueue::Wakeup");
+  }
+}
+
+void NgxFetchQueue::ReadHandler(ngx_event_t* ev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
+  NgxFetchQueue* queue = static_cast<NgxFetchQueue*>(c->data);
+
+  // Clear the fd before taking the list; see Notify().
+  char buf[64];
+  ssize_t rc;
+  do {
+    rc = read(queue->read_fd_, buf, sizeof(buf));
+  } while (rc > 0 || (rc == -1 && errno == EINTR));
+
+  queue->Drain();
+
+  if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                  "pagespeed fetch queue: failed to re-arm read event");
+  }
+}
+
+void NgxFetchQueue::Drain() {
+  Entry* list;
+  do {
+    list = head_;
+  } while (!__sync_bool_compare_and_swap(&head_, list, NULL));
+
+  // The list is newest first; reverse it so notifications run in order.
+  Entry* ordered = NULL;
+  while (list != NULL) {
+    Entry* next = list->next;
+    list->next = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  while (ordered != NULL) {
+    Entry* entry = ordered;
+    ordered = entry->next;
+    if (entry->fetch != NULL) {
+      handler_(entry->fetch);
+      entry->fetch->DecrefAndDeleteIfUnreferenced();
+    } else {
+      entry->task->CallRun();
+    }
+    delete entry;
+  }
+}
+
+}  // namespace net_instaweb
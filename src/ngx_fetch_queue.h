@@ -0,0 +1,105 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tells an nginx worker which base fetches have output for it.
+//
+// There is one queue per worker process.  Rewrite threads call Notify() with a
+// base fetch that has new headers, data, or completion to report.  The fetch
+// is pushed onto a lock-free list and, if the list was empty, the worker is
+// woken through an eventfd (a pipe where eventfd isn't available).  The worker
+// then drains the whole list in one read handler, calling the handler once per
+// notification in the order they were made.
+//
+// Other work that has to happen on the worker, like starting a native fetch,
+// can be queued the same way with Run().
+
+#ifndef NGX_FETCH_QUEUE_H_
+#define NGX_FETCH_QUEUE_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+}
+
+#include <pthread.h>
+
+#include "net/instaweb/util/public/basictypes.h"
+
+namespace net_instaweb {
+
+class Function;
+class NgxBaseFetch;
+
+class NgxFetchQueue {
+ public:
+  // Called on the worker's event loop for each notification.
+  typedef void (*Handler)(NgxBaseFetch* fetch);
+
+  explicit NgxFetchQueue(Handler handler);
+  ~NgxFetchQueue();
+
+  // Creates the notification fd and registers it with the event loop.  Must be
+  // called in the worker process.  Returns NGX_OK or NGX_ERROR.
+  ngx_int_t Init(ngx_log_t* log);
+
+  // Queue fetch for the worker and wake it up if needed.  The queue holds a
+  // reference to fetch until the handler has run.  Thread safe.
+  void Notify(NgxBaseFetch* fetch);
+
+  // Queue task to be run on the worker, in order with notifications.  Thread
+  // safe.
+  void Run(Function* task);
+
+  // Whether we're being called from the worker's event loop thread.
+  bool OnWorkerThread() const {
+    return pthread_equal(pthread_self(), worker_thread_) != 0;
+  }
+
+ private:
+  // Exactly one of fetch and task is set.
+  struct Entry {
+    NgxBaseFetch* fetch;
+    Function* task;
+    Entry* next;
+  };
+
+  static void ReadHandler(ngx_event_t* ev);
+
+  // Add entry to the list, waking the worker if needed.
+  void Push(Entry* entry);
+
+  // Write to the notification fd so the worker will call ReadHandler().
+  void Wakeup();
+
+  // Run the handler for everything queued so far.
+  void Drain();
+
+  Handler handler_;
+  // Most recent notification first.  Producers push with compare-and-swap and
+  // the worker takes the whole list at once, so there's no ABA problem.
+  Entry* volatile head_;
+  int read_fd_;
+  int write_fd_;
+  ngx_connection_t* connection_;
+  pthread_t worker_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxFetchQueue);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_FETCH_QUEUE_H_
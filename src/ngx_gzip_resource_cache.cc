@@ -0,0 +1,233 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_gzip_resource_cache.h"
+
+#include <zlib.h>
+
+#include "net/instaweb/automatic/public/resource_fetch.h"
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/http/public/content_type.h"
+#include "net/instaweb/http/public/http_cache.h"
+#include "net/instaweb/http/public/http_value.h"
+#include "net/instaweb/http/public/meta_data.h"
+#include "net/instaweb/http/public/response_headers.h"
+#include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "net/instaweb/rewriter/public/server_context.h"
+#include "net/instaweb/util/public/google_url.h"
+#include "net/instaweb/util/public/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kKeyPrefix[] = "ngx_gzip/";
+
+// Bigger resources are passed through uncompressed rather than held in memory
+// to compress.
+const size_t kMaxCompressedInputBytes = 1024 * 1024;  // 1MB
+
+// Gzips ResourceFetch output for base_fetch, caching the result.  Output we
+// shouldn't or can't compress passes straight through.
+class GzipVariantWriter : public SharedAsyncFetch {
+ public:
+  GzipVariantWriter(AsyncFetch* base_fetch, HTTPCache* http_cache,
+                    const GoogleString& key, int level)
+      : SharedAsyncFetch(base_fetch),
+        http_cache_(http_cache),
+        key_(key),
+        level_(level),
+        compress_(false),
+        handler_(NULL) {
+  }
+
+ protected:
+  virtual void HandleHeadersComplete() {
+    ResponseHeaders* headers = response_headers();
+    const ContentType* content_type = headers->DetermineContentType();
+    compress_ = (headers->status_code() == HttpStatus::kOK &&
+                 content_type != NULL &&
+                 (content_type->IsCss() || content_type->IsJs()) &&
+                 !headers->Has(HttpAttributes::kContentEncoding));
+    if (!compress_) {
+      SharedAsyncFetch::HandleHeadersComplete();
+    }
+  }
+
+  virtual bool HandleWrite(const StringPiece& sp, MessageHandler* handler) {
+    if (!compress_) {
+      return SharedAsyncFetch::HandleWrite(sp, handler);
+    }
+    handler_ = handler;
+    if (body_.size() + sp.size() > kMaxCompressedInputBytes) {
+      // Too big to hold; send what we have and pass the rest through.
+      compress_ = false;
+      SharedAsyncFetch::HandleHeadersComplete();
+      bool ok = SharedAsyncFetch::HandleWrite(body_, handler);
+      body_.clear();
+      return ok && SharedAsyncFetch::HandleWrite(sp, handler);
+    }
+    sp.AppendToString(&body_);
+    return true;
+  }
+
+  virtual bool HandleFlush(MessageHandler* handler) {
+    if (compress_) {
+      return true;  // Nothing goes out until we've compressed it all.
+    }
+    return SharedAsyncFetch::HandleFlush(handler);
+  }
+
+  virtual void HandleDone(bool success) {
+    if (compress_) {
+      GoogleString gzipped;
+      if (success && NgxGzipResourceCache::Gzip(body_, level_, &gzipped) &&
+          gzipped.size() < body_.size()) {
+        ResponseHeaders* headers = response_headers();
+        headers->Add(HttpAttributes::kContentEncoding, HttpAttributes::kGzip);
+        if (!headers->HasValue(HttpAttributes::kVary,
+                               HttpAttributes::kAcceptEncoding)) {
+          headers->Add(HttpAttributes::kVary, HttpAttributes::kAcceptEncoding);
+        }
+        headers->RemoveAll(HttpAttributes::kContentLength);
+        headers->ComputeCaching();
+        if (headers->IsProxyCacheable()) {
+          http_cache_->Put(key_, headers, gzipped, handler_);
+        }
+        body_.swap(gzipped);
+      }
+      SharedAsyncFetch::HandleHeadersComplete();
+      if (!body_.empty()) {
+        SharedAsyncFetch::HandleWrite(body_, handler_);
+      }
+    }
+    SharedAsyncFetch::HandleDone(success);
+    delete this;
+  }
+
+ private:
+  HTTPCache* http_cache_;
+  GoogleString key_;
+  int level_;
+  bool compress_;
+  GoogleString body_;
+  MessageHandler* handler_;
+
+  DISALLOW_COPY_AND_ASSIGN(GzipVariantWriter);
+};
+
+class GzipVariantLookup : public HTTPCache::Callback {
+ public:
+  GzipVariantLookup(const GoogleUrl& url, const GoogleString& key, int level,
+                    RewriteDriver* driver, AsyncFetch* base_fetch,
+                    MessageHandler* handler)
+      : url_(url.Spec().as_string()),
+        key_(key),
+        level_(level),
+        driver_(driver),
+        base_fetch_(base_fetch),
+        handler_(handler) {
+  }
+
+  virtual void Done(HTTPCache::FindResult find_result) {
+    ServerContext* server_context = driver_->server_context();
+    Statistics* statistics = server_context->statistics();
+
+    StringPiece contents;
+    if (find_result == HTTPCache::kFound &&
+        http_value()->ExtractContents(&contents)) {
+      statistics->GetVariable(NgxGzipResourceCache::kHits)->Add(1);
+      base_fetch_->response_headers()->CopyFrom(*response_headers());
+      base_fetch_->HeadersComplete();
+      base_fetch_->Write(contents, handler_);
+      base_fetch_->Done(true);
+      driver_->Cleanup();
+    } else {
+      statistics->GetVariable(NgxGzipResourceCache::kMisses)->Add(1);
+      // The writer deletes itself on Done().
+      GzipVariantWriter* writer = new GzipVariantWriter(
+          base_fetch_, server_context->http_cache(), key_, level_);
+      ResourceFetch::StartWithDriver(GoogleUrl(url_), server_context, driver_,
+                                     writer);
+    }
+    delete this;
+  }
+
+ private:
+  GoogleString url_;
+  GoogleString key_;
+  int level_;
+  RewriteDriver* driver_;
+  AsyncFetch* base_fetch_;
+  MessageHandler* handler_;
+
+  DISALLOW_COPY_AND_ASSIGN(GzipVariantLookup);
+};
+
+}  // namespace
+
+const char NgxGzipResourceCache::kHits[] =
+    "ngx_pagespeed_gzip_resource_cache_hits";
+const char NgxGzipResourceCache::kMisses[] =
+    "ngx_pagespeed_gzip_resource_cache_misses";
+
+void NgxGzipResourceCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kHits);
+  statistics->AddVariable(kMisses);
+}
+
+bool NgxGzipResourceCache::Gzip(StringPiece in, int level, GoogleString* out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 more window bits asks for a gzip header and trailer.
+  if (deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  // deflateBound() doesn't count the gzip header and trailer in older zlibs.
+  out->resize(deflateBound(&stream, in.size()) + 32);
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  stream.avail_in = in.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  stream.avail_out = out->size();
+  int rc = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (rc != Z_STREAM_END) {
+    out->clear();
+    return false;
+  }
+  out->resize(stream.total_out);
+  return true;
+}
+
+GoogleString NgxGzipResourceCache::VariantKey(StringPiece url, int level) {
+  // .pagespeed. urls name the exact content, so the url is enough of a key.
+  return StrCat(kKeyPrefix, IntegerToString(level), "/", url);
+}
+
+void NgxGzipResourceCache::Lookup(const GoogleUrl& url, int level,
+                                  RewriteDriver* driver,
+                                  AsyncFetch* base_fetch,
+                                  MessageHandler* handler) {
+  GoogleString key = VariantKey(url.Spec(), level);
+
+  // May call back right away, on this thread.
+  driver->server_context()->http_cache()->Find(
+      key, handler,
+      new GzipVariantLookup(url, key, level, driver, base_fetch, handler));
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Keeps gzipped copies of .pagespeed. css and javascript in the http cache.
+//
+// Rewritten resources are cached uncompressed, so with gzip on nginx would
+// compress the same bytes again for every client.  With GzipResourceLevel set,
+// requests from clients that accept gzip first look for a gzipped variant of
+// the resource.  A hit is served as is, with Content-Encoding set so nginx's
+// gzip filter leaves it alone.  A miss runs the ResourceFetch as usual,
+// compresses its output once, caches that under the variant's key, and serves
+// it.
+
+#ifndef NGX_GZIP_RESOURCE_CACHE_H_
+#define NGX_GZIP_RESOURCE_CACHE_H_
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class AsyncFetch;
+class GoogleUrl;
+class MessageHandler;
+class RewriteDriver;
+class Statistics;
+
+class NgxGzipResourceCache {
+ public:
+  static const char kHits[];
+  static const char kMisses[];
+
+  static void InitStats(Statistics* statistics);
+
+  // Gzips in at level, 1 through 9.  Returns false on failure.
+  static bool Gzip(StringPiece in, int level, GoogleString* out);
+
+  // The http cache key of url's variant gzipped at level.
+  static GoogleString VariantKey(StringPiece url, int level);
+
+  // Looks up the gzipped variant of url.  On a hit writes it to base_fetch,
+  // calls Done(), and cleans up driver.  On a miss starts a ResourceFetch for
+  // url with driver and gzips its output on the way to base_fetch, caching the
+  // result.  Either way base_fetch gets Done() exactly once, possibly on
+  // another thread.  Only call this for clients that accept gzip.
+  static void Lookup(const GoogleUrl& url, int level, RewriteDriver* driver,
+                     AsyncFetch* base_fetch, MessageHandler* handler);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(NgxGzipResourceCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_GZIP_RESOURCE_CACHE_H_
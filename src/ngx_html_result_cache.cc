@@ -0,0 +1,209 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_html_result_cache.h"
+
+#include "net/instaweb/automatic/public/proxy_fetch.h"
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/rewriter/public/server_context.h"
+#include "net/instaweb/util/public/cache_interface.h"
+#include "net/instaweb/util/public/hasher.h"
+#include "net/instaweb/util/public/shared_string.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/timer.h"
+#include "net/instaweb/util/public/user_agent_matcher.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kKeyPrefix[] = "ngx_html_result/";
+
+// Rewritten pages bigger than this aren't worth a cache entry.
+const size_t kMaxCachedBytes = 1024 * 1024;  // 1MB
+
+// The user agent properties filters look at when deciding what to emit.
+GoogleString UserAgentClass(const UserAgentMatcher& matcher,
+                            StringPiece user_agent) {
+  GoogleString ua_class;
+  ua_class += matcher.IsIe(user_agent) ? 'e' : '-';
+  ua_class += matcher.IsMobileUserAgent(user_agent) ? 'm' : '-';
+  ua_class += matcher.SupportsImageInlining(user_agent) ? 'i' : '-';
+  ua_class += matcher.SupportsWebp(user_agent) ? 'w' : '-';
+  return ua_class;
+}
+
+// Entries are "<expiry ms>:<rewritten html>".  Sets output and returns true if
+// entry is well formed and hasn't expired.
+bool ParseEntry(StringPiece entry, int64 now_ms, StringPiece* output) {
+  stringpiece_ssize_type colon = entry.find(':');
+  if (colon == StringPiece::npos) {
+    return false;
+  }
+  int64 expiry_ms;
+  if (!StringToInt64(entry.substr(0, colon).as_string(), &expiry_ms) ||
+      expiry_ms <= now_ms) {
+    return false;
+  }
+  *output = entry.substr(colon + 1);
+  return true;
+}
+
+// Passes ProxyFetch output through to the base fetch, keeping a copy to cache
+// if the rewrite succeeds.
+class HtmlResultWriter : public SharedAsyncFetch {
+ public:
+  HtmlResultWriter(AsyncFetch* base_fetch, CacheInterface* cache,
+                   const GoogleString& key, int64 expiry_ms)
+      : SharedAsyncFetch(base_fetch),
+        cache_(cache),
+        key_(key),
+        entry_(StrCat(Integer64ToString(expiry_ms), ":")),
+        too_big_(false) {
+  }
+
+ protected:
+  virtual bool HandleWrite(const StringPiece& sp, MessageHandler* handler) {
+    if (!too_big_) {
+      if (entry_.size() + sp.size() > kMaxCachedBytes) {
+        too_big_ = true;
+        entry_.clear();
+      } else {
+        sp.AppendToString(&entry_);
+      }
+    }
+    return SharedAsyncFetch::HandleWrite(sp, handler);
+  }
+
+  virtual void HandleDone(bool success) {
+    if (success && !too_big_) {
+      SharedString value(entry_);
+      cache_->Put(key_, &value);
+    }
+    SharedAsyncFetch::HandleDone(success);
+    delete this;
+  }
+
+ private:
+  CacheInterface* cache_;
+  GoogleString key_;
+  GoogleString entry_;
+  bool too_big_;
+
+  DISALLOW_COPY_AND_ASSIGN(HtmlResultWriter);
+};
+
+class HtmlResultLookup : public CacheInterface::Callback {
+ public:
+  HtmlResultLookup(const GoogleString& url, GoogleString* input,
+                   const GoogleString& key, int64 ttl_ms,
+                   RewriteDriver* driver, ProxyFetchFactory* factory,
+                   AsyncFetch* base_fetch, MessageHandler* handler)
+      : url_(url),
+        key_(key),
+        ttl_ms_(ttl_ms),
+        driver_(driver),
+        factory_(factory),
+        base_fetch_(base_fetch),
+        handler_(handler) {
+    input_.swap(*input);
+  }
+
+  virtual void Done(CacheInterface::KeyState state) {
+    ServerContext* server_context = driver_->server_context();
+    Statistics* statistics = server_context->statistics();
+    int64 now_ms = server_context->timer()->NowMs();
+
+    StringPiece output;
+    if (state == CacheInterface::kAvailable &&
+        ParseEntry(value()->Value(), now_ms, &output)) {
+      statistics->GetVariable(NgxHtmlResultCache::kHits)->Add(1);
+      base_fetch_->Write(output, handler_);
+      base_fetch_->Done(true);
+      driver_->Cleanup();
+    } else {
+      statistics->GetVariable(NgxHtmlResultCache::kMisses)->Add(1);
+      HtmlResultWriter* writer = new HtmlResultWriter(
+          base_fetch_, server_context->metadata_cache(), key_,
+          now_ms + ttl_ms_);
+      // The ProxyFetch deletes itself on Done(), and the writer when the
+      // ProxyFetch calls its Done().
+      ProxyFetch* proxy_fetch = factory_->CreateNewProxyFetch(
+          url_, writer, driver_,
+          NULL /* property_callback */,
+          NULL /* original_content_fetch */);
+      proxy_fetch->Write(input_, handler_);
+      proxy_fetch->Done(true /* success */);
+    }
+    delete this;
+  }
+
+ private:
+  GoogleString url_;
+  GoogleString input_;
+  GoogleString key_;
+  int64 ttl_ms_;
+  RewriteDriver* driver_;
+  ProxyFetchFactory* factory_;
+  AsyncFetch* base_fetch_;
+  MessageHandler* handler_;
+
+  DISALLOW_COPY_AND_ASSIGN(HtmlResultLookup);
+};
+
+}  // namespace
+
+const char NgxHtmlResultCache::kHits[] = "ngx_pagespeed_html_result_cache_hits";
+const char NgxHtmlResultCache::kMisses[] =
+    "ngx_pagespeed_html_result_cache_misses";
+
+void NgxHtmlResultCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kHits);
+  statistics->AddVariable(kMisses);
+}
+
+bool NgxHtmlResultCache::IsCacheable(const RewriteOptions* options) {
+  return !options->running_furious() &&
+      !options->Enabled(RewriteOptions::kDeferJavascript) &&
+      !options->Enabled(RewriteOptions::kDelayImages) &&
+      !options->Enabled(RewriteOptions::kFlushSubresources) &&
+      !options->Enabled(RewriteOptions::kInlinePreviewImages) &&
+      !options->Enabled(RewriteOptions::kLazyloadImages);
+}
+
+void NgxHtmlResultCache::Lookup(const GoogleString& url, GoogleString* input,
+                                StringPiece user_agent, int64 ttl_ms,
+                                RewriteDriver* driver,
+                                ProxyFetchFactory* factory,
+                                AsyncFetch* base_fetch,
+                                MessageHandler* handler) {
+  ServerContext* server_context = driver->server_context();
+  // The output depends on the url too: relative urls in the html are resolved
+  // against it when resources get rewritten.
+  GoogleString key = StrCat(
+      kKeyPrefix, server_context->hasher()->Hash(*input), "/",
+      driver->options()->signature(), "/",
+      UserAgentClass(driver->user_agent_matcher(), user_agent), "/", url);
+
+  // May call back right away, on this thread.
+  server_context->metadata_cache()->Get(
+      key, new HtmlResultLookup(url, input, key, ttl_ms, driver, factory,
+                                base_fetch, handler));
+}
+
+}  // namespace net_instaweb
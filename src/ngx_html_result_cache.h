@@ -0,0 +1,75 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Caches rewritten html, keyed on the upstream html it was rewritten from.
+//
+// Pages that don't change between requests go through the whole html parse
+// and filter chain every time.  With HtmlResultCacheTtlMs set we instead
+// buffer the upstream body and look up the output we produced last time for
+// the same url, bytes, options signature, and user-agent class.  A hit is
+// written straight to the base fetch and no ProxyFetch is started.  A miss
+// starts the ProxyFetch as usual, with its output copied into the metadata
+// cache as it goes by.
+//
+// The cache has no expiry of its own, so entries carry the time after which
+// we stop using them.  That also bounds how long we keep serving output from
+// before pagespeed finished optimizing a page's resources.
+
+#ifndef NGX_HTML_RESULT_CACHE_H_
+#define NGX_HTML_RESULT_CACHE_H_
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class AsyncFetch;
+class MessageHandler;
+class ProxyFetchFactory;
+class RewriteDriver;
+class RewriteOptions;
+class Statistics;
+
+class NgxHtmlResultCache {
+ public:
+  static const char kHits[];
+  static const char kMisses[];
+
+  static void InitStats(Statistics* statistics);
+
+  // Whether output under options depends only on the input html, the options
+  // signature, and the user agent.  Filters that use the property cache or
+  // other per-request state make it depend on more.
+  static bool IsCacheable(const RewriteOptions* options);
+
+  // Looks up output for input, which this swaps out.  On a hit writes it to
+  // base_fetch, calls Done(), and cleans up driver.  On a miss starts a
+  // ProxyFetch for url with driver, writes input to it, and caches its output
+  // for ttl_ms.  Either way base_fetch gets Done() exactly once, possibly on
+  // another thread.
+  static void Lookup(const GoogleString& url, GoogleString* input,
+                     StringPiece user_agent, int64 ttl_ms,
+                     RewriteDriver* driver, ProxyFetchFactory* factory,
+                     AsyncFetch* base_fetch, MessageHandler* handler);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(NgxHtmlResultCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_HTML_RESULT_CACHE_H_
@@ -32,23 +32,45 @@ extern "C" {
 }
 
 #include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
 
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_server_context.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_base_fetch.h"
+#include "ngx_fetch_queue.h"
+#include "ngx_url_async_fetcher.h"
+#include "ngx_gzip_resource_cache.h"
+#include "ngx_html_result_cache.h"
+#include "ngx_rewrite_driver_pool.h"
 
+#include "net/instaweb/automatic/public/flush_early_flow.h"
 #include "net/instaweb/automatic/public/proxy_fetch.h"
 #include "net/instaweb/rewriter/public/furious_matcher.h"
+#include "net/instaweb/rewriter/public/furious_util.h"
+#include "net/instaweb/rewriter/public/in_place_resource_recorder.h"
 #include "net/instaweb/rewriter/public/process_context.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
 #include "net/instaweb/rewriter/public/static_javascript_manager.h"
 #include "net/instaweb/public/global_constants.h"
 #include "net/instaweb/public/version.h"
+#include "net/instaweb/http/public/content_type.h"
+#include "net/instaweb/http/public/http_cache.h"
+#include "net/instaweb/http/public/http_names.h"
+#include "net/instaweb/http/public/response_headers.h"
 #include "net/instaweb/util/public/file_system_lock_manager.h"
+#include "net/instaweb/util/public/filename_encoder.h"
 #include "net/instaweb/util/public/google_message_handler.h"
 #include "net/instaweb/util/public/google_url.h"
+#include "net/instaweb/util/public/property_cache.h"
+#include "net/instaweb/util/public/statistics.h"
 #include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+#include "net/instaweb/util/public/thread_system.h"
 #include "net/instaweb/automatic/public/resource_fetch.h"
 
 extern ngx_module_t ngx_pagespeed;
@@ -57,7 +79,7 @@ extern ngx_module_t ngx_pagespeed;
 #define DBG(r, args...)                                       \
   ngx_log_error(NGX_LOG_DEBUG, (r)->connection->log, 0, args)
 #define PDBG(ctx, args...)                                       \
-  ngx_log_error(NGX_LOG_DEBUG, (ctx)->pagespeed_connection->log, 0, args)
+  ngx_log_error(NGX_LOG_DEBUG, (ctx)->r->connection->log, 0, args)
 #define CDBG(cf, args...)                                     \
   ngx_conf_log_error(NGX_LOG_DEBUG, cf, 0, args)
 
@@ -84,7 +106,8 @@ string_piece_to_pool_string(ngx_pool_t* pool, StringPiece sp) {
 ngx_int_t
 string_piece_to_buffer_chain(
     ngx_pool_t* pool, StringPiece sp, ngx_chain_t** link_ptr,
-    bool send_last_buf) {
+    bool send_last_buf, size_t max_buffer_size) {
+  CHECK(max_buffer_size > 0);
 
   if (!send_last_buf && sp.size() == 0) {
     // Nothing to send, not even the metadata that this is the last buffer.
@@ -101,8 +124,6 @@ string_piece_to_buffer_chain(
   // How far into sp we're currently working on.
   ngx_uint_t offset;
 
-  // TODO(jefftk): look up the nginx buffer size properly.
-  ngx_uint_t max_buffer_size = 8192;  // 8k
   for (offset = 0 ;
        offset < sp.size() ||
            // If we need to send the last buffer bit and there's no data, we
@@ -172,11 +193,110 @@ string_piece_to_buffer_chain(
   return NGX_OK;
 }
 
+// How big a piece of output to hand nginx at once.  nginx keeps the
+// output_buffers setting private to its copy filter, so OutputSegmentBytes
+// stands in for it.
+size_t
+output_buffer_size(ngx_http_request_t* r,
+                   net_instaweb::NgxRewriteOptions* options) {
+  ngx_http_core_loc_conf_t* clcf = static_cast<ngx_http_core_loc_conf_t*>(
+      ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+
+  size_t size = 0;
+  if (options != NULL) {
+    size = options->output_segment_bytes();
+  }
+  if (size < clcf->postpone_output) {
+    // Anything smaller would just be held back by the postpone filter.
+    size = clcf->postpone_output;
+  }
+  if (size == 0) {
+    size = 32 * 1024;  // 32k, nginx's default output_buffers size.
+  }
+  return size;
+}
+
 namespace {
 
+// The "scheme://host[:port]" start of the last url we built for a server, and
+// what it was built from.  Nearly every request to a server has the same one,
+// so we can skip rebuilding it.
+struct ps_url_prefix_t {
+  bool is_https;
+  ngx_uint_t port;
+  GoogleString host;
+  GoogleString prefix;
+};
+
+// A static javascript snippet, ready to serve.  Built the first time a worker
+// serves it and kept for the life of the process; the snippets never change,
+// and each has a content hash in its name.
+struct ps_static_asset_t {
+  GoogleString body;
+  // Empty if gzip didn't make it any smaller.
+  GoogleString gzipped_body;
+  GoogleString cache_control;
+  GoogleString etag;
+};
+
+typedef std::map<GoogleString, ps_static_asset_t*> ps_static_asset_map_t;
+
+// A .pagespeed. url that some worker is fetching, in the table shared by all
+// workers; see ps_coalesce.
+struct ps_coalesce_slot_t {
+  // Hash of the url, or 0 if the slot is free.
+  ngx_atomic_t key;
+  // Wall clock ms, modulo the word size, after which the claim is abandoned.
+  ngx_atomic_t deadline_ms;
+};
+
+// Urls that can be in flight at once; with the table full, requests just
+// don't wait for each other.
+const ngx_uint_t kCoalesceSlots = 4096;
+// How many slots past its own a url may land in.
+const ngx_uint_t kCoalesceProbes = 8;
+// How often waiting requests check whether they can go.
+const ngx_msec_t kCoalescePollMs = 10;
+
+// Most html we keep to send instead if pagespeed misses its deadline.
+const size_t kMaxOriginalHtmlBytes = 1024 * 1024;  // 1MB
+
+// Most html we hold back from the client to look up in the html result cache.
+const size_t kMaxHtmlCacheInputBytes = 1024 * 1024;  // 1MB
+
+// Output space we give each inflate() call for gzipped upstream html.
+const size_t kInflateChunkBytes = 16 * 1024;  // 16k
+
+// Most response header bytes we believe a file cache entry has; anything
+// bigger isn't an entry we wrote.
+const off_t kMaxFileCacheHeadersBytes = 64 * 1024;  // 64k
+
+// How many recent html rewrite times a worker keeps, and for how long, to
+// judge whether it's keeping up.
+const ngx_uint_t kHtmlLoadSamples = 128;
+const ngx_msec_t kHtmlLoadWindowMs = 10 * 1000;
+// Fewer than this say little about the 99th percentile.
+const ngx_uint_t kHtmlLoadMinSamples = 20;
+
+// Html rewriting in progress in this worker; see ps_shed_html.
+struct ps_html_load_t {
+  ngx_uint_t in_flight;
+  // A ring of the most recent completed rewrites.
+  ngx_msec_t finished_msec[kHtmlLoadSamples];
+  ngx_msec_t latency_ms[kHtmlLoadSamples];
+  ngx_uint_t num_samples;
+  ngx_uint_t next_sample;
+};
+
 typedef struct {
   net_instaweb::NgxRewriteDriverFactory* driver_factory;
   net_instaweb::MessageHandler* handler;
+  // Created per worker process in ps_init_child_process.
+  net_instaweb::NgxFetchQueue* fetch_queue;
+  // Holds the ps_coalesce_slot_t table.
+  ngx_shm_zone_t* coalesce_zone;
+  // Per worker process; allocated on first use by ps_get_html_load.
+  ps_html_load_t* html_load;
 } ps_main_conf_t;
 
 typedef struct {
@@ -190,23 +310,89 @@ typedef struct {
   net_instaweb::ProxyFetchFactory* proxy_fetch_factory;
   net_instaweb::NgxRewriteOptions* options;
   net_instaweb::MessageHandler* handler;
+  // Per worker process; allocated on first use by ps_determine_url.
+  ps_url_prefix_t* url_prefix;
+  // Per worker process; filled in by ps_static_handler.
+  ps_static_asset_map_t* static_assets;
+  // Only set if the global options run an experiment; otherwise requests
+  // without location options use the server context's own drivers.
+  net_instaweb::NgxRewriteDriverPools* driver_pools;
 } ps_srv_conf_t;
 
 typedef struct {
   net_instaweb::NgxRewriteOptions* options;
   net_instaweb::MessageHandler* handler;
+  // Set whenever options is.
+  net_instaweb::NgxRewriteDriverPools* driver_pools;
 } ps_loc_conf_t;
 
 typedef struct {
   net_instaweb::ProxyFetch* proxy_fetch;
   net_instaweb::NgxBaseFetch* base_fetch;
   bool data_received;
-  int pipe_fd;
-  ngx_connection_t* pagespeed_connection;
   ngx_http_request_t* r;
   bool is_resource_fetch;
   bool sent_headers;
   bool write_pending;
+
+  // Flush policy for HTML going into proxy_fetch; see NgxRewriteOptions.
+  size_t flush_buffer_bytes;
+  ngx_msec_t flush_delay_ms;
+  ngx_msec_t min_flush_interval_ms;
+  // Input written since the last flush.
+  size_t unflushed_bytes;
+  ngx_msec_t last_flush_msec;
+  bool saw_head_end;
+  // The end of the input so far, for finding a </head> split across buffers.
+  u_char head_end_tail[6];
+  size_t head_end_tail_len;
+  // Flushes input that has waited too long, or a flush we had to postpone.
+  ngx_event_t flush_timer;
+
+  // In-place resource optimization.  in_place_check is set while we look for
+  // an optimized version in the cache.  On a miss we let nginx serve the
+  // request as usual and set in_place_miss, and recorder saves the response
+  // so it can be optimized for later requests.
+  bool in_place_check;
+  bool in_place_miss;
+  net_instaweb::InPlaceResourceRecorder* recorder;
+
+  // Html result cache.  While html_cache_driver is set we buffer the upstream
+  // body in html_cache_input instead of starting a ProxyFetch; see
+  // NgxHtmlResultCache.
+  net_instaweb::RewriteDriver* html_cache_driver;
+  GoogleString html_cache_url;
+  GoogleString html_cache_input;
+  int64 html_cache_ttl_ms;
+
+  // Set while this request is the one fetching its url for everyone else who
+  // wants it; see ps_coalesce.
+  ps_coalesce_slot_t* coalesce_slot;
+  ngx_atomic_uint_t coalesce_key;
+
+  // Set while this html response counts against the worker's load shedding
+  // limits.
+  bool html_rewrite_counted;
+
+  // HtmlRewriteDeadlineMs.  Until pagespeed sends any output we keep a copy
+  // of the html we gave it in original_html (html_cache_input while we're
+  // still collecting it for the html result cache) so that if the deadline
+  // passes first we can send that instead and pass the rest of the response
+  // through unrewritten.
+  ngx_msec_t rewrite_deadline_ms;
+  ngx_event_t deadline_timer;
+  bool keep_original_html;
+  GoogleString original_html;
+  // Whether we've seen the last of the upstream body, and when.
+  bool input_done;
+  ngx_msec_t input_done_msec;
+  bool deadline_passed;
+
+  // Set if upstream sent the html gzipped.  ps_body_filter inflates each chain
+  // into inflated, which pagespeed or the next body filter gets instead.
+  z_stream* inflate_stream;
+  bool inflate_done;
+  GoogleString inflated;
 } ps_request_ctx_t;
 
 ngx_int_t
@@ -227,23 +413,64 @@ ps_release_request_context(void* data);
 void
 ps_set_buffered(ngx_http_request_t* r, bool on);
 
+ngx_int_t
+ps_coalesce_init_zone(ngx_shm_zone_t* zone, void* data);
+
+void
+ps_coalesce_release(ps_request_ctx_t* ctx);
+
+void
+ps_html_rewrite_finished(ps_request_ctx_t* ctx, bool completed);
+
 GoogleString
 ps_determine_url(ngx_http_request_t* r);
 
 ps_request_ctx_t*
 ps_get_request_context(ngx_http_request_t* r);
 
+ps_srv_conf_t*
+ps_get_srv_config(ngx_http_request_t* r);
+
 void
 ps_initialize_server_context(ps_srv_conf_t* cfg);
 
 ngx_int_t
-ps_update(ps_request_ctx_t* ctx, ngx_event_t* ev);
+ps_update(ps_request_ctx_t* ctx);
 
 void
-ps_connection_read_handler(ngx_event_t* ev);
+ps_base_fetch_handler(net_instaweb::NgxBaseFetch* base_fetch);
 
 ngx_int_t
-ps_create_connection(ps_request_ctx_t* ctx);
+ngx_http_set_pagespeed_write_handler(ngx_http_request_t* r);
+
+void
+ps_flush_timer_handler(ngx_event_t* ev);
+
+void
+ps_deadline_timer_handler(ngx_event_t* ev);
+
+void
+ps_cancel_rewrite_deadline(ps_request_ctx_t* ctx);
+
+void
+ps_in_place_miss(ps_request_ctx_t* ctx);
+
+void
+ps_buffer_for_html_cache(ngx_http_request_t* r,
+                         ps_request_ctx_t* ctx,
+                         ps_srv_conf_t* cfg_s,
+                         ngx_chain_t* in);
+
+void
+ps_in_place_start_recording(ngx_http_request_t* r,
+                            ps_request_ctx_t* ctx,
+                            ps_srv_conf_t* cfg_s);
+
+void
+ps_in_place_record(ngx_http_request_t* r,
+                   ps_request_ctx_t* ctx,
+                   ps_srv_conf_t* cfg_s,
+                   ngx_chain_t* in);
 
 namespace CreateRequestContext {
 enum Response {
@@ -421,6 +648,142 @@ void ps_merge_options(net_instaweb::NgxRewriteOptions* parent_options,
   }
 }
 
+// A prefix location, or the server block itself as "/", that might serve files
+// straight from disk.
+struct ps_file_location_t {
+  StringPiece prefix;
+  ngx_http_core_loc_conf_t* clcf;
+};
+
+// Collects this server's prefix locations into static_locations if nginx
+// serves them straight from root or alias, and into dynamic_locations if it
+// hands them to a content handler like proxy_pass or restricts who may fetch
+// them with internal or limit_except.  Returns true if there are any regex
+// locations, which may take urls from prefix locations without ^~.
+bool
+ps_collect_file_locations(
+    ngx_queue_t* locations,
+    std::vector<ps_file_location_t>* static_locations,
+    std::vector<StringPiece>* dynamic_locations) {
+  bool saw_regex = false;
+  if (locations == NULL) {
+    return saw_regex;
+  }
+  for (ngx_queue_t* q = ngx_queue_head(locations);
+       q != ngx_queue_sentinel(locations);
+       q = ngx_queue_next(q)) {
+    ngx_http_location_queue_t* lq =
+        reinterpret_cast<ngx_http_location_queue_t*>(q);
+    ngx_http_core_loc_conf_t* clcf =
+        (lq->exact != NULL) ? lq->exact : lq->inclusive;
+    if (clcf->named || clcf->noname) {
+      continue;
+    }
+#if (NGX_PCRE)
+    if (clcf->regex != NULL) {
+      saw_regex = true;
+      continue;
+    }
+#endif
+    StringPiece prefix = str_to_string_piece(clcf->name);
+    if (clcf->handler != NULL || clcf->root_lengths != NULL ||
+        clcf->internal || clcf->limit_except) {
+      dynamic_locations->push_back(prefix);
+    } else if (!clcf->exact_match) {
+      ps_file_location_t location = { prefix, clcf };
+      static_locations->push_back(location);
+    }
+    if (ps_collect_file_locations(
+            clcf->locations, static_locations, dynamic_locations)) {
+      saw_regex = true;
+    }
+  }
+  return saw_regex;
+}
+
+bool
+ps_file_location_shorter(const ps_file_location_t& a,
+                         const ps_file_location_t& b) {
+  return a.prefix.size() < b.prefix.size();
+}
+
+// With LoadFromRoot on, tell pagespeed to read this server's own static
+// resources from disk instead of fetching them back from us over http.  Only
+// locations where every url under them is served from root or alias are
+// mapped, since we can't tell which files a proxied or regex location would
+// return, and none with internal or limit_except, since reading their files
+// would get around that.  Access modules like allow/deny and auth_basic keep
+// their configuration private, so those we can't see; the README says not to
+// use LoadFromRoot with them.  Pagespeed checks mtimes to know when the files
+// change.
+void
+ps_load_from_root(ngx_conf_t* cf, net_instaweb::NgxRewriteOptions* options) {
+  ngx_http_core_srv_conf_t* cscf = static_cast<ngx_http_core_srv_conf_t*>(
+      ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module));
+  ngx_http_core_loc_conf_t* server_clcf =
+      static_cast<ngx_http_core_loc_conf_t*>(
+          cscf->ctx->loc_conf[ngx_http_core_module.ctx_index]);
+
+  std::vector<ps_file_location_t> static_locations;
+  std::vector<StringPiece> dynamic_locations;
+  ps_file_location_t server_location = { "/", server_clcf };
+  static_locations.push_back(server_location);
+  bool saw_regex = ps_collect_file_locations(
+      server_clcf->locations, &static_locations, &dynamic_locations);
+  // Map shorter prefixes first so more specific locations override them.
+  std::stable_sort(static_locations.begin(), static_locations.end(),
+                   ps_file_location_shorter);
+
+  std::vector<GoogleString> hosts;
+  ngx_http_server_name_t* names =
+      static_cast<ngx_http_server_name_t*>(cscf->server_names.elts);
+  for (ngx_uint_t i = 0; i < cscf->server_names.nelts; i++) {
+    StringPiece name = str_to_string_piece(names[i].name);
+    // Regex and wildcard names don't give us a host to map.
+    if (name.empty() || name[0] == '~' || name[0] == '.' ||
+        name.find('*') != StringPiece::npos) {
+      continue;
+    }
+    hosts.push_back(name.as_string());
+  }
+  if (hosts.empty()) {
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "pagespeed LoadFromRoot needs a server_name");
+    return;
+  }
+
+  for (size_t i = 0; i < static_locations.size(); i++) {
+    const ps_file_location_t& location = static_locations[i];
+    ngx_http_core_loc_conf_t* clcf = location.clcf;
+    if (clcf->root_lengths != NULL ||
+        (saw_regex && !clcf->noregex)) {
+      continue;
+    }
+    bool shadowed = false;
+    for (size_t j = 0; j < dynamic_locations.size(); j++) {
+      if (dynamic_locations[j].starts_with(location.prefix)) {
+        shadowed = true;
+        break;
+      }
+    }
+    if (shadowed) {
+      continue;
+    }
+
+    // A root has the whole uri appended to it, an alias only what follows the
+    // location's prefix.
+    GoogleString filename_prefix = str_to_string_piece(clcf->root).as_string();
+    if (!clcf->alias) {
+      StrAppend(&filename_prefix, location.prefix);
+    }
+    for (size_t j = 0; j < hosts.size(); j++) {
+      options->file_load_policy()->Associate(
+          net_instaweb::StrCat("http://", hosts[j], location.prefix),
+          filename_prefix);
+    }
+  }
+}
+
 // Called exactly once per server block to merge the main configuration with the
 // configuration for this server.
 char*
@@ -454,6 +817,17 @@ ps_merge_srv_conf(ngx_conf_t* cf, void* parent, void* child) {
     // top-level config and so sticks around as long as we're running.
 
     cfg_m->driver_factory = new net_instaweb::NgxRewriteDriverFactory();
+
+    ngx_str_t zone_name = ngx_string("pagespeed_coalesce");
+    // Room for the table plus the slab allocator's bookkeeping.
+    cfg_m->coalesce_zone = ngx_shared_memory_add(
+        cf, &zone_name,
+        kCoalesceSlots * sizeof(ps_coalesce_slot_t) + 8 * ngx_pagesize,
+        &ngx_pagespeed);
+    if (cfg_m->coalesce_zone == NULL) {
+      return const_cast<char*>("couldn't set up shared memory");
+    }
+    cfg_m->coalesce_zone->init = ps_coalesce_init_zone;
   }
 
   cfg_s->server_context = new net_instaweb::NgxServerContext(
@@ -466,6 +840,10 @@ ps_merge_srv_conf(ngx_conf_t* cf, void* parent, void* child) {
   delete cfg_s->options;
   cfg_s->options = NULL;
 
+  if (cfg_s->server_context->config()->load_from_root()) {
+    ps_load_from_root(cf, cfg_s->server_context->config());
+  }
+
   StringPiece filename_prefix =
       cfg_s->server_context->config()->file_cache_path();
   cfg_s->server_context->set_lock_manager(
@@ -477,9 +855,26 @@ ps_merge_srv_conf(ngx_conf_t* cf, void* parent, void* child) {
 
   cfg_m->driver_factory->InitServerContext(cfg_s->server_context);
 
+  if (cfg_s->server_context->config()->use_native_fetcher()) {
+    net_instaweb::NgxUrlAsyncFetcher* fetcher =
+        cfg_m->driver_factory->GetNgxFetcher(
+            cfg_s->server_context->config(), cf);
+    if (fetcher == NULL) {
+      return const_cast<char*>("couldn't set up the native fetcher");
+    }
+    cfg_s->server_context->set_default_system_fetcher(fetcher);
+  }
+
   cfg_s->proxy_fetch_factory =
       new net_instaweb::ProxyFetchFactory(cfg_s->server_context);
 
+  // Without an experiment, requests that only need the global options use
+  // NewRewriteDriver() directly.
+  if (cfg_s->server_context->global_options()->running_furious()) {
+    cfg_s->driver_pools = new net_instaweb::NgxRewriteDriverPools(
+        cfg_s->server_context, *cfg_s->server_context->global_options());
+  }
+
   return NGX_CONF_OK;
 }
 
@@ -513,6 +908,9 @@ ps_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child) {
   // parent_cfg_l.  Rebase the directory specific options on the global options.
   ps_merge_options(cfg_s->server_context->config(), &cfg_l->options);
 
+  cfg_l->driver_pools = new net_instaweb::NgxRewriteDriverPools(
+      cfg_s->server_context, *cfg_l->options);
+
   return NGX_CONF_OK;
 }
 
@@ -523,6 +921,31 @@ void
 ps_release_request_context(void* data) {
   ps_request_ctx_t* ctx = static_cast<ps_request_ctx_t*>(data);
 
+  if (ctx->flush_timer.timer_set) {
+    ngx_del_timer(&ctx->flush_timer);
+  }
+  if (ctx->deadline_timer.timer_set) {
+    ngx_del_timer(&ctx->deadline_timer);
+  }
+
+  ps_coalesce_release(ctx);
+  ps_html_rewrite_finished(ctx, false /* completed */);
+
+  if (ctx->inflate_stream != NULL) {
+    inflateEnd(ctx->inflate_stream);
+    delete ctx->inflate_stream;
+  }
+
+  // The response was cut short, so don't cache what we have of it.
+  delete ctx->recorder;
+
+  // Likewise if we were still buffering html to look up.  Pagespeed never got
+  // the base fetch, so drop the reference we took for it.
+  if (ctx->html_cache_driver != NULL) {
+    ctx->html_cache_driver->Cleanup();
+    ctx->base_fetch->DecrefAndDeleteIfUnreferenced();
+  }
+
   // proxy_fetch deleted itself if we called Done(), but if an error happened
   // before then we need to tell it to delete itself.
   //
@@ -531,22 +954,10 @@ ps_release_request_context(void* data) {
     ctx->proxy_fetch->Done(false /* failure */);
   }
 
-  // BaseFetch doesn't delete itself in HandleDone() because we still need to
-  // recieve notification via pipe and call CollectAccumulatedWrites.
-  // TODO(jefftk): If we close the proxy_fetch above and not in the normal flow,
-  // can this delete base_fetch while proxy_fetch still needs it? Is there a
-  // race condition here?
-  delete ctx->base_fetch;
-
-  // Close the connection, delete the events attached with it, and free it to
-  // Nginx's connection pool
-  if (ctx->pagespeed_connection != NULL) {
-    ngx_close_connection(ctx->pagespeed_connection);
-    ctx->pipe_fd = -1;
-  }
-
-  if (ctx->pipe_fd != -1) {
-    close(ctx->pipe_fd);
+  // BaseFetch is reference counted, so if pagespeed or the fetch queue still
+  // need it this only detaches it from the request.
+  if (ctx->base_fetch != NULL) {
+    ctx->base_fetch->Release();
   }
 
   delete ctx;
@@ -586,6 +997,27 @@ ps_determine_url(ngx_http_request_t* r) {
         r->connection->local_sockaddr)->sin_port);
   }
 
+  StringPiece host = str_to_string_piece(r->headers_in.server);
+  StringPiece uri = str_to_string_piece(r->unparsed_uri);
+
+  // Reuse the prefix from the last request to this server if it matches.  We
+  // don't cache the no-host case below, which is rare and has to look up the
+  // local address anyway.
+  ps_url_prefix_t* cached = NULL;
+  if (host.size() != 0) {
+    ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+    if (cfg_s->url_prefix == NULL) {
+      cfg_s->url_prefix = new ps_url_prefix_t;
+      cfg_s->url_prefix->port = 0;
+      cfg_s->url_prefix->is_https = false;
+    }
+    cached = cfg_s->url_prefix;
+    if (cached->is_https == is_https && cached->port == port &&
+        !cached->prefix.empty() && host == cached->host) {
+      return net_instaweb::StrCat(cached->prefix, uri);
+    }
+  }
+
   GoogleString port_string;
   if ((is_https && port == 443) || (!is_https && port == 80)) {
     // No port specifier needed for requests on default ports.
@@ -595,12 +1027,11 @@ ps_determine_url(ngx_http_request_t* r) {
         ":", net_instaweb::IntegerToString(port));
   }
 
-  StringPiece host = str_to_string_piece(r->headers_in.server);
+  ngx_str_t  s;
+  u_char addr[NGX_SOCKADDR_STRLEN];
   if (host.size() == 0) {
     // If host is unspecified, perhaps because of a pure HTTP 1.0 "GET /path",
     // fall back to server IP address.  Based on ngx_http_variable_server_addr.
-    ngx_str_t  s;
-    u_char addr[NGX_SOCKADDR_STRLEN];
     s.len = NGX_SOCKADDR_STRLEN;
     s.data = addr;
     ngx_int_t rc = ngx_connection_local_sockaddr(r->connection, &s, 0);
@@ -610,9 +1041,29 @@ ps_determine_url(ngx_http_request_t* r) {
     host =  str_to_string_piece(s);
   }
 
-  return net_instaweb::StrCat(
-      is_https ? "https://" : "http://", host, port_string,
-      str_to_string_piece(r->unparsed_uri));
+  GoogleString prefix = net_instaweb::StrCat(
+      is_https ? "https://" : "http://", host, port_string);
+
+  if (cached != NULL) {
+    cached->is_https = is_https;
+    cached->port = port;
+    host.CopyToString(&cached->host);
+    cached->prefix = prefix;
+  }
+
+  return net_instaweb::StrCat(prefix, uri);
+}
+
+// Whether r could be for a pagespeed resource or our static content.  Every
+// pagespeed resource has ".pagespeed." in its name, so this lets the content
+// handler turn away everything else without building and parsing a url.  May
+// return true for requests that turn out not to be resources.
+bool
+ps_may_be_pagespeed_resource(ngx_http_request_t* r) {
+  StringPiece uri = str_to_string_piece(r->unparsed_uri);
+  return (uri.find(".pagespeed.") != StringPiece::npos ||
+          uri.starts_with(
+              net_instaweb::NgxRewriteDriverFactory::kStaticJavaScriptPrefix));
 }
 
 // Get the context for this request.  ps_create_request_context
@@ -628,72 +1079,103 @@ ps_get_request_context(ngx_http_request_t* r) {
 //   NGX_AGAIN: pagespeed still working, needs to be called again later
 //   NGX_ERROR: error
 ngx_int_t
-ps_update(ps_request_ctx_t* ctx, ngx_event_t* ev) {
-  bool done;
-  int rc;
-  char chr;
-  do {
-    rc = read(ctx->pipe_fd, &chr, 1);
-  } while (rc == -1 && errno == EINTR);  // Retry on EINTR.
-
-  // read() should only ever return 0 (closed), 1 (data), or -1 (error).
-  CHECK(rc == -1 || rc == 0 || rc == 1);
-
-  if (rc == -1) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      PDBG(ctx, "no data to read from pagespeed yet");
-      return NGX_AGAIN;
-    } else {
-      perror("ps_connection_read_handler");
-      return NGX_ERROR;
-    }
-  } else {
-    // We're done iff we read 0 bytes because that means the pipe was closed.
-    done = (rc == 0);
-  }
+ps_update(ps_request_ctx_t* ctx) {
+  ngx_int_t rc;
 
   // Get output from pagespeed.
   if (ctx->is_resource_fetch && !ctx->sent_headers) {
-    // For resource fetches, the first pipe-byte tells us headers are available
-    // for fetching.
+    // For resource fetches, the first notification tells us headers are
+    // available for fetching.
     rc = ctx->base_fetch->CollectHeaders(&ctx->r->headers_out);
     if (rc != NGX_OK) {
       PDBG(ctx, "problem with CollectHeaders");
       return rc;
     }
 
+    // nginx's range filter can cut a single range out of the body as we send
+    // it, as long as it knows the length up front.
+    if (ctx->r->headers_out.status == NGX_HTTP_OK &&
+        ctx->r->headers_out.content_length_n >= 0) {
+      ctx->r->allow_ranges = 1;
+      ctx->r->single_range = 1;
+    }
+
     ngx_http_send_header(ctx->r);
     ctx->sent_headers = true;
-  } else {
-    // For proxy fetches and subsequent resource fetch pipe-bytes, the response
-    // body is available for (partial) fetching.
-    ngx_chain_t* cl;
-    rc = ctx->base_fetch->CollectAccumulatedWrites(&cl);
-    if (rc != NGX_OK) {
-      PDBG(ctx, "problem with CollectAccumulatedWrites");
-      return rc;
-    }
+  }
+
+  // The response body may be available for (partial) fetching.  Any data
+  // written since our last notification is picked up here too.
+  ngx_chain_t* cl;
+  rc = ctx->base_fetch->CollectAccumulatedWrites(&cl);
+  if (rc != NGX_OK) {
+    PDBG(ctx, "problem with CollectAccumulatedWrites");
+    return rc;
+  }
 
-    PDBG(ctx, "pagespeed update: %p, done: %d", cl, done);
+  bool done = ctx->base_fetch->last_buf_sent();
+  PDBG(ctx, "pagespeed update: %p, done: %d", cl, done);
 
-    // Pass the optimized content along to later body filters.
-    // From Weibin: This function should be called mutiple times. Store the
-    // whole file in one chain buffers is too aggressive. It could consume
-    // too much memory in busy servers.
-    rc = ngx_http_next_body_filter(ctx->r, cl);
-    if (rc == NGX_AGAIN && done) {
-      ctx->write_pending = 1;
-      return NGX_OK;
+  if (done) {
+    // The result is cached by now, so requests waiting on this one can have
+    // it without waiting for us to finish sending it.  Likewise the rewrite
+    // is finished even if the client hasn't got all of it yet.
+    ps_coalesce_release(ctx);
+    ps_html_rewrite_finished(ctx, true /* completed */);
+    ps_cancel_rewrite_deadline(ctx);
+  }
+
+  if (ctx->r->header_only) {
+    // A HEAD request, or a status without a body.  The headers were all the
+    // client needed, so drop the body as it arrives, marking it sent so the
+    // base fetch can reuse its segments.
+    for (; cl != NULL; cl = cl->next) {
+      cl->buf->pos = cl->buf->last;
+      cl->buf->file_pos = cl->buf->file_last;
     }
+    return done ? NGX_OK : NGX_AGAIN;
+  }
 
-    if (rc != NGX_OK) {
-      return rc;
+  if (cl == NULL) {
+    // Nothing new to send yet.
+    return done ? NGX_OK : NGX_AGAIN;
+  }
+
+  // Once the client has some of pagespeed's output it has to get all of it.
+  ps_cancel_rewrite_deadline(ctx);
+
+  // Pass the optimized content along to later body filters.
+  // From Weibin: This function should be called mutiple times. Store the
+  // whole file in one chain buffers is too aggressive. It could consume
+  // too much memory in busy servers.
+  rc = ngx_http_next_body_filter(ctx->r, cl);
+  if (rc == NGX_AGAIN && done) {
+    ctx->write_pending = 1;
+    return NGX_OK;
+  }
+
+  if (rc == NGX_AGAIN && ctx->is_resource_fetch) {
+    // The client is slow.  Get called back when it can take more so we can
+    // recycle what's been sent, which lets pagespeed write to memory again
+    // instead of spilling past MaxBufferedOutputBytes.  Only resources are
+    // ours to do this for: html is still being proxied, and upstream relies on
+    // the request's event handlers for its own flow control.  For html,
+    // ps_body_filter and our next notification push out and recycle what's
+    // pending instead.
+    if (ngx_http_set_pagespeed_write_handler(ctx->r) != NGX_OK) {
+      return NGX_ERROR;
     }
   }
 
+  if (rc != NGX_OK && rc != NGX_AGAIN) {
+    return rc;
+  }
+
   return done ? NGX_OK : NGX_AGAIN;
 }
 
+// Write handler for requests we own: resource fetches, and html once pagespeed
+// is done with it and upstream has let go.  See ps_update.
 void
 ps_writer(ngx_http_request_t* r)
 {
@@ -719,6 +1201,19 @@ ps_writer(ngx_http_request_t* r)
                  "http pagespeed writer output filter: %d, \"%V?%V\"",
                  rc, &r->uri, &r->args);
 
+  ps_request_ctx_t* ctx = ps_get_request_context(r);
+  if (rc != NGX_ERROR && ctx != NULL && ctx->base_fetch != NULL &&
+      !ctx->base_fetch->last_buf_sent()) {
+    // Pagespeed isn't done yet.  Now that some output has gone out, collect
+    // anything new.  This recycles what was sent, so pagespeed can write to
+    // memory again instead of spilling past MaxBufferedOutputBytes.
+    if (rc != NGX_AGAIN) {
+      r->write_event_handler = ngx_http_request_empty_handler;
+    }
+    ps_base_fetch_handler(ctx->base_fetch);
+    return;
+  }
+
   if (rc == NGX_AGAIN) {
     return;
   }
@@ -750,72 +1245,70 @@ ngx_http_set_pagespeed_write_handler(ngx_http_request_t *r)
   return NGX_OK;
 }
 
+// Called by the worker's fetch queue whenever base_fetch has new headers,
+// output, or has finished.
 void
-ps_connection_read_handler(ngx_event_t* ev) {
-  CHECK(ev != NULL);
-
-  ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
-  CHECK(c != NULL);
+ps_base_fetch_handler(net_instaweb::NgxBaseFetch* base_fetch) {
+  ngx_http_request_t* r = base_fetch->request();
+  if (r == NULL || base_fetch->last_buf_sent()) {
+    // Either nginx is done with this request or we already handled the final
+    // collection; this is a stale notification.
+    return;
+  }
 
-  ps_request_ctx_t* ctx =
-      static_cast<ps_request_ctx_t*>(c->data);
+  ps_request_ctx_t* ctx = ps_get_request_context(r);
   CHECK(ctx != NULL);
 
-  int rc = ps_update(ctx, ev);
-  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
-                 "http pagespeed connection read handler rc: %d", rc);
+  // We're about to collect everything pending, so later output needs to wake
+  // us again.
+  base_fetch->ClearCollectionRequest();
+
+  if (ctx->in_place_check) {
+    // The first notification comes once headers are complete, which tells us
+    // whether the cache had the resource.
+    ctx->in_place_check = false;
+    if (base_fetch->response_headers()->status_code() !=
+        net_instaweb::HttpStatus::kOK) {
+      ps_in_place_miss(ctx);
+      return;
+    }
+    // A hit, so we serve the request from here on.  Unlike the content phase,
+    // the access phase didn't finalize the NGX_DONE ps_in_place_handler
+    // returned, so drop the reference it took ourselves.
+    r->main->count--;
+  }
+
+  ngx_int_t rc = ps_update(ctx);
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "http pagespeed fetch handler rc: %d", rc);
 
   if (rc == NGX_AGAIN) {
-    // Request needs more work by pagespeed.
-    rc = ngx_handle_read_event(ev, 0);
-    CHECK(rc == NGX_OK);
+    // Request needs more work by pagespeed.  We'll be notified again.
   } else if (rc == NGX_OK) {
-    // Pagespeed is done.  Stop watching the pipe.  If we still have data to
-    // write, set a write handler so we can get called back to make our write.
-    ngx_del_event(ev, NGX_READ_EVENT, 0);
-    ps_set_buffered(ctx->r, false);
+    // Pagespeed is done.  If we still have data to write, set a write handler
+    // so we can get called back to make our write.
+    net_instaweb::Statistics* statistics =
+        ps_get_srv_config(r)->server_context->statistics();
+    statistics->GetVariable(net_instaweb::NgxBaseFetch::kFetchWakeups)->Add(
+        base_fetch->wakeups());
+    statistics->GetVariable(
+        net_instaweb::NgxBaseFetch::kFetchResponses)->Add(1);
+
+    ps_set_buffered(r, false);
     if (ctx->write_pending) {
-      if (ngx_http_set_pagespeed_write_handler(ctx->r) != NGX_OK) {
-        ngx_http_finalize_request(ctx->r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      if (ngx_http_set_pagespeed_write_handler(r) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
       }
     } else {
-      ngx_http_finalize_request(ctx->r, NGX_DONE);
+      ngx_http_finalize_request(r, NGX_DONE);
     }
   } else if (rc == NGX_ERROR) {
-    ngx_http_finalize_request(ctx->r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
   } else {
     CHECK(false);
   }
 }
 
-ngx_int_t
-ps_create_connection(ps_request_ctx_t* ctx) {
-  ngx_connection_t* c = ngx_get_connection(
-      ctx->pipe_fd, ctx->r->connection->log);
-  if (c == NULL) {
-    return NGX_ERROR;
-  }
-
-  c->recv = ngx_recv;
-  c->send = ngx_send;
-  c->recv_chain = ngx_recv_chain;
-  c->send_chain = ngx_send_chain;
-
-  c->log_error = ctx->r->connection->log_error;
-
-  c->read->log = c->log;
-  c->write->log = c->log;
-
-  ctx->pagespeed_connection = c;
-
-  // Tell nginx to monitor this pipe and call us back when there's data.
-  c->data = ctx;
-  c->read->handler = ps_connection_read_handler;
-  ngx_add_event(c->read, NGX_READ_EVENT, 0);
-
-  return NGX_OK;
-}
-
 // Populate cfg_* with configuration information for this
 // request.  Thin wrappers around ngx_http_get_module_*_conf and cast.
 ps_srv_conf_t*
@@ -828,6 +1321,11 @@ ps_get_loc_config(ngx_http_request_t* r) {
   return static_cast<ps_loc_conf_t*>(
       ngx_http_get_module_loc_conf(r, ngx_pagespeed));
 }
+ps_main_conf_t*
+ps_get_main_config(ngx_http_request_t* r) {
+  return static_cast<ps_main_conf_t*>(
+      ngx_http_get_module_main_conf(r, ngx_pagespeed));
+}
 
 // Wrapper around GetQueryOptions()
 bool
@@ -861,19 +1359,81 @@ ps_determine_request_options(
   return true;
 }
 
+// Returns the first request header called name, or NULL.
+ngx_table_elt_t*
+ps_find_request_header(ngx_http_request_t* r, StringPiece name) {
+  // Standard nginx idiom for iterating over a list.  See ngx_list.h
+  ngx_uint_t i;
+  ngx_list_part_t* part = &r->headers_in.headers.part;
+  ngx_table_elt_t* header = static_cast<ngx_table_elt_t*>(part->elts);
+  for (i = 0 ; /* void */; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL) {
+        break;
+      }
+      part = part->next;
+      header = static_cast<ngx_table_elt_t*>(part->elts);
+      i = 0;
+    }
+
+    if (net_instaweb::StringCaseEqual(str_to_string_piece(header[i].key),
+                                      name)) {
+      return &header[i];
+    }
+  }
+  return NULL;
+}
+
+// Whether anything in the request (query parameters or headers) could set
+// pagespeed options.  Looks at nginx's own copies so we don't need to convert
+// the request headers just to find out.  May return true for requests that
+// don't end up setting anything.
+bool
+ps_request_may_set_options(ngx_http_request_t* r) {
+  if (str_to_string_piece(r->args).find("ModPagespeed") != StringPiece::npos) {
+    return true;
+  }
+
+  // Standard nginx idiom for iterating over a list.  See ngx_list.h
+  ngx_uint_t i;
+  ngx_list_part_t* part = &r->headers_in.headers.part;
+  ngx_table_elt_t* header = static_cast<ngx_table_elt_t*>(part->elts);
+  for (i = 0 ; /* void */; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL) {
+        break;
+      }
+      part = part->next;
+      header = static_cast<ngx_table_elt_t*>(part->elts);
+      i = 0;
+    }
+
+    StringPiece key = str_to_string_piece(header[i].key);
+    if (net_instaweb::StringCaseStartsWith(key, "ModPagespeed") ||
+        net_instaweb::StringCaseStartsWith(key, "X-PSA-")) {
+      return true;
+    }
+  }
+  return false;
+}
+
 // There are many sources of options:
 //  - the request (query parameters and headers)
 //  - location block
 //  - global server options
 //  - experiment framework
 // Consider them all, returning appropriate options for this request, of which
-// the caller takes ownership.  If the only applicable options are global,
-// set options to NULL so we can use server_context->global_options().
+// the caller takes ownership.  If the options were already built at
+// configuration time, set pool to the driver pool that uses them and options
+// to NULL.  If the only applicable options are global, set both to NULL so we
+// can use server_context->global_options().
 bool
 ps_determine_options(ngx_http_request_t* r,
                      ps_request_ctx_t* ctx,
                      net_instaweb::RewriteOptions** options,
+                     net_instaweb::RewriteDriverPool** pool,
                      net_instaweb::GoogleUrl* url) {
+  *pool = NULL;
 
   ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
   ps_loc_conf_t* cfg_l = ps_get_loc_config(r);
@@ -895,6 +1455,29 @@ ps_determine_options(ngx_http_request_t* r,
     return false;
   }
 
+  // Without request options, directory options and experiment arms are fixed
+  // per location, so we can use the options precomputed for them.  The one
+  // exception is a visitor we haven't assigned to an experiment arm yet, who
+  // needs to be classified and sent a cookie below.
+  net_instaweb::NgxRewriteDriverPools* pools =
+      directory_options != NULL ? cfg_l->driver_pools : cfg_s->driver_pools;
+  if (request_options == NULL && pools != NULL) {
+    if (!pools->pool()->TargetOptions()->running_furious()) {
+      *options = NULL;
+      *pool = pools->pool();
+      return true;
+    }
+    int furious_state;
+    if (net_instaweb::furious::GetFuriousCookieState(
+            *ctx->base_fetch->request_headers(), &furious_state)) {
+      *pool = pools->ExperimentPool(furious_state);
+      if (*pool != NULL) {
+        *options = NULL;
+        return true;
+      }
+    }
+  }
+
   // Because the caller takes memory ownership of any options we return, the
   // only situation in which we can avoid allocating a new RewriteOptions is if
   // the global options are ok as are.
@@ -917,6 +1500,7 @@ ps_determine_options(ngx_http_request_t* r,
   // settings.
   if (request_options != NULL) {
     (*options)->Merge(*request_options);
+    delete request_options;
   } else if ((*options)->running_furious()) {
     (*options)->set_need_to_store_experiment_data(
         cfg_s->server_context->furious_matcher()->ClassifyIntoExperiment(
@@ -927,11 +1511,87 @@ ps_determine_options(ngx_http_request_t* r,
 }
 
 
+// Start reading the page's entry in the property cache, so filters that use
+// cohort data (critical images, flush early) have it when parsing starts.
+// Compare to ProxyInterface::InitiatePropertyCacheLookup, which also looks up
+// the client property cache; we don't get a client id from nginx requests.
+// Returns NULL if there's nothing to look up, otherwise the collector to hand
+// to CreateNewProxyFetch.
+net_instaweb::ProxyFetchPropertyCallbackCollector*
+ps_initiate_property_cache_lookup(ngx_http_request_t* r,
+                                  ps_srv_conf_t* cfg_s,
+                                  const net_instaweb::GoogleUrl& url,
+                                  const net_instaweb::RewriteOptions* options) {
+  net_instaweb::ServerContext* server_context = cfg_s->server_context;
+  net_instaweb::PropertyCache* page_property_cache =
+      server_context->page_property_cache();
+  if (page_property_cache == NULL || !page_property_cache->enabled() ||
+      r->method != NGX_HTTP_GET) {
+    return NULL;
+  }
+
+  net_instaweb::ProxyFetchPropertyCallbackCollector* collector =
+      new net_instaweb::ProxyFetchPropertyCallbackCollector(
+          server_context, url.Spec(), options);
+  net_instaweb::ProxyFetchPropertyCallback* page_callback =
+      new net_instaweb::ProxyFetchPropertyCallback(
+          net_instaweb::ProxyFetchPropertyCallback::kPagePropertyCache,
+          url.Spec(), collector,
+          server_context->thread_system()->NewMutex());
+  collector->AddCallback(page_callback);
+  page_property_cache->Read(page_callback);
+  return collector;
+}
+
+// Start rewriting the html for r with driver, which the ProxyFetch takes over.
+void
+ps_start_proxy_fetch(ngx_http_request_t* r,
+                     ps_request_ctx_t* ctx,
+                     ps_srv_conf_t* cfg_s,
+                     const net_instaweb::GoogleUrl& url,
+                     const GoogleString& url_string,
+                     net_instaweb::RewriteDriver* driver) {
+  // We're usually called from the header filter, so the lookup runs while
+  // nginx waits for the body.  ProxyFetch holds the html until it completes.
+  net_instaweb::ProxyFetchPropertyCallbackCollector* property_callback =
+      ps_initiate_property_cache_lookup(r, cfg_s, url, driver->options());
+
+  // If the property cache remembers what this page's head needs, send that
+  // now rather than waiting for the upstream body and the rewriter.  Our
+  // header filter has already run by the time it's collected, so it goes
+  // out as the start of the body.  FlushEarlyFlow may put its own fetch in
+  // front of base_fetch, and then ProxyFetch writes through it.
+  net_instaweb::AsyncFetch* fetch = ctx->base_fetch;
+  if (property_callback != NULL &&
+      driver->options()->Enabled(
+          net_instaweb::RewriteOptions::kFlushSubresources)) {
+    net_instaweb::FlushEarlyFlow::TryStart(
+        url_string, &fetch, driver, cfg_s->proxy_fetch_factory,
+        property_callback);
+    if (fetch != ctx->base_fetch) {
+      cfg_s->server_context->statistics()->GetVariable(
+          net_instaweb::NgxRewriteDriverFactory::kFlushEarlyResponses)->Add(
+              1);
+    }
+  }
+
+  // Will call StartParse etc.  The rewrite driver will take care of deleting
+  // itself if necessary.  ProxyFetch takes ownership of property_callback.
+  ctx->proxy_fetch = cfg_s->proxy_fetch_factory->CreateNewProxyFetch(
+      url_string, fetch, driver,
+      property_callback,
+      NULL /* original_content_fetch */);
+}
+
 // Set us up for processing a request.
 CreateRequestContext::Response
 ps_create_request_context(ngx_http_request_t* r, bool is_resource_fetch) {
   ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
 
+  if (is_resource_fetch && !ps_may_be_pagespeed_resource(r)) {
+    return CreateRequestContext::kNotUnderstood;
+  }
+
   GoogleString url_string = ps_determine_url(r);
   net_instaweb::GoogleUrl url(url_string);
 
@@ -954,50 +1614,34 @@ ps_create_request_context(ngx_http_request_t* r, bool is_resource_fetch) {
     }
   }
 
-  int file_descriptors[2];
-  int rc = pipe(file_descriptors);
-  if (rc != 0) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "pipe() failed");
-    return CreateRequestContext::kError;
-  }
-
-  if (ngx_nonblocking(file_descriptors[0]) == -1) {
-    ngx_log_error(NGX_LOG_EMERG, r->connection->log, ngx_socket_errno,
-                  ngx_nonblocking_n " pipe[0] failed");
-    return CreateRequestContext::kError;
+  // If pagespeed is off here and nothing in the request could turn it on, stop
+  // before we set up a fetch and copy the request headers.
+  net_instaweb::RewriteOptions* config_options = ps_get_loc_config(r)->options;
+  if (config_options == NULL) {
+    config_options = cfg_s->server_context->global_options();
   }
-
-  if (ngx_nonblocking(file_descriptors[1]) == -1) {
-    ngx_log_error(NGX_LOG_EMERG, r->connection->log, ngx_socket_errno,
-                  ngx_nonblocking_n " pipe[1] failed");
-    return CreateRequestContext::kError;
+  if (!config_options->enabled() && !ps_request_may_set_options(r)) {
+    return CreateRequestContext::kPagespeedDisabled;
   }
 
   ps_request_ctx_t* ctx = new ps_request_ctx_t();
   ctx->r = r;
-  ctx->pipe_fd = file_descriptors[0];
   ctx->is_resource_fetch = is_resource_fetch;
   ctx->write_pending = false;
-  ctx->pagespeed_connection = NULL;
-
-  rc = ps_create_connection(ctx);
-  if (rc != NGX_OK) {
-    close(file_descriptors[1]);
 
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "ps_create_request_context: "
-                  "no pagespeed connection.");
-    ps_release_request_context(ctx);
-    return CreateRequestContext::kError;
-  }
+  // Holds nginx's reference until ps_release_request_context; pagespeed takes
+  // its own reference below when we hand the fetch off.
+  ctx->base_fetch = new net_instaweb::NgxBaseFetch(
+      r, ps_get_main_config(r)->fetch_queue);
 
-  // Deletes itself when HandleDone is called, which happens when we call Done()
-  // on the proxy fetch below.
-  ctx->base_fetch = new net_instaweb::NgxBaseFetch(r, file_descriptors[1]);
+  // Option parsing, the experiment framework, and pagespeed itself all read
+  // these, so everything from here on needs them.
+  ctx->base_fetch->PopulateRequestHeaders();
 
-  // If null, that means use global options.
+  // If both are null, that means use global options.
   net_instaweb::RewriteOptions* custom_options;
-  bool ok = ps_determine_options(r, ctx, &custom_options, &url);
+  net_instaweb::RewriteDriverPool* driver_pool;
+  bool ok = ps_determine_options(r, ctx, &custom_options, &driver_pool, &url);
   if (!ok) {
     ps_release_request_context(ctx);
     return CreateRequestContext::kError;
@@ -1008,47 +1652,109 @@ ps_create_request_context(ngx_http_request_t* r, bool is_resource_fetch) {
   url.Spec().CopyToString(&url_string);
 
   net_instaweb::RewriteOptions* options;
-  if (custom_options == NULL) {
-    options = cfg_s->server_context->global_options();
-  } else {
+  if (custom_options != NULL) {
     options = custom_options;
+  } else if (driver_pool != NULL) {
+    options = driver_pool->TargetOptions();
+  } else {
+    options = cfg_s->server_context->global_options();
   }
 
   if (!options->enabled()) {
+    delete custom_options;
     ps_release_request_context(ctx);
     return CreateRequestContext::kPagespeedDisabled;
   }
 
-  // TODO(jefftk): port ProxyInterface::InitiatePropertyCacheLookup so that we
-  // have the propery cache in nginx.
+  net_instaweb::NgxRewriteOptions* ngx_options =
+      net_instaweb::NgxRewriteOptions::DynamicCast(options);
+  if (ngx_options != NULL) {
+    ctx->base_fetch->set_max_buffered_bytes(
+        ngx_options->max_buffered_output_bytes());
+    ctx->base_fetch->set_max_worker_buffered_bytes(
+        ngx_options->max_worker_buffered_output_bytes());
+    ctx->base_fetch->set_max_spill_bytes(
+        ngx_options->max_spilled_output_bytes());
+  }
+  ctx->base_fetch->set_segment_size(output_buffer_size(r, ngx_options));
+
+  if (ngx_options != NULL) {
+    ctx->flush_buffer_bytes = ngx_options->flush_buffer_bytes();
+    ctx->flush_delay_ms = ngx_options->flush_delay_ms();
+    ctx->min_flush_interval_ms = ngx_options->min_flush_interval_ms();
+    ctx->html_cache_ttl_ms = ngx_options->html_result_cache_ttl_ms();
+    ctx->rewrite_deadline_ms = ngx_options->html_rewrite_deadline_ms();
+  }
+  ctx->last_flush_msec = ngx_current_msec;
+  ctx->flush_timer.handler = ps_flush_timer_handler;
+  ctx->flush_timer.data = ctx;
+  ctx->flush_timer.log = r->connection->log;
+  ctx->deadline_timer.handler = ps_deadline_timer_handler;
+  ctx->deadline_timer.data = ctx;
+  ctx->deadline_timer.log = r->connection->log;
+
+  // Released in NgxBaseFetch::HandleDone().
+  ctx->base_fetch->IncrementRefCount();
+
+  // Clients that take gzip can get the variant we compressed last time.
+  int gzip_level = 0;
+#if (NGX_HTTP_GZIP)
+  if (is_resource_fetch && ngx_options != NULL &&
+      ngx_options->gzip_resource_level() > 0 &&
+      ngx_http_gzip_ok(r) == NGX_OK) {
+    gzip_level = ngx_options->gzip_resource_level();
+  }
+#endif
 
-  if (is_resource_fetch) {
+  if (gzip_level > 0) {
+    net_instaweb::RewriteDriver* driver;
+    if (driver_pool != NULL) {
+      driver = cfg_s->server_context->NewRewriteDriverFromPool(driver_pool);
+    } else if (custom_options != NULL) {
+      // NewCustomRewriteDriver takes ownership of custom_options.
+      driver = cfg_s->server_context->NewCustomRewriteDriver(custom_options);
+    } else {
+      driver = cfg_s->server_context->NewRewriteDriver();
+    }
+    net_instaweb::NgxGzipResourceCache::Lookup(
+        url, gzip_level, driver, ctx->base_fetch, cfg_s->handler);
+  } else if (is_resource_fetch && driver_pool != NULL) {
+    net_instaweb::ResourceFetch::StartWithDriver(
+        url, cfg_s->server_context,
+        cfg_s->server_context->NewRewriteDriverFromPool(driver_pool),
+        ctx->base_fetch);
+  } else if (is_resource_fetch) {
     // TODO(jefftk): Set using_spdy appropriately.  See
     // ProxyInterface::ProxyRequestCallback
     net_instaweb::ResourceFetch::Start(
         url, custom_options /* null if there aren't custom options */,
         false /* using_spdy */, cfg_s->server_context, ctx->base_fetch);
   } else {
-    // If we don't have custom options we can use NewRewriteDriver which reuses
-    // rewrite drivers and so is faster because there's no wait to construct
-    // them.  Otherwise we have to build a new one every time.
+    // Unless we have custom options we can use pooled drivers, which are
+    // faster because there's no wait to construct them.  Otherwise we have to
+    // build a new one every time.
     net_instaweb::RewriteDriver* driver;
-    if (custom_options == NULL) {
-      driver = cfg_s->server_context->NewRewriteDriver();
-    } else {
+    if (custom_options != NULL) {
       // NewCustomRewriteDriver takes ownership of custom_options.
       driver = cfg_s->server_context->NewCustomRewriteDriver(custom_options);
+    } else if (driver_pool != NULL) {
+      driver = cfg_s->server_context->NewRewriteDriverFromPool(driver_pool);
+    } else {
+      driver = cfg_s->server_context->NewRewriteDriver();
     }
     driver->set_log_record(ctx->base_fetch->log_record());
 
-    // TODO(jefftk): FlushEarlyFlow would go here.
-
-    // Will call StartParse etc.  The rewrite driver will take care of deleting
-    // itself if necessary.
-    ctx->proxy_fetch = cfg_s->proxy_fetch_factory->CreateNewProxyFetch(
-        url_string, ctx->base_fetch, driver,
-        NULL /* property_callback */,
-        NULL /* original_content_fetch */);
+    // Options from the request, or an experiment cookie we still have to set,
+    // make the output depend on more than the html.
+    if (ctx->html_cache_ttl_ms > 0 && custom_options == NULL &&
+        r->headers_out.status == NGX_HTTP_OK &&
+        net_instaweb::NgxHtmlResultCache::IsCacheable(driver->options())) {
+      // Wait for the whole upstream body; ps_body_filter takes it from here.
+      ctx->html_cache_driver = driver;
+      ctx->html_cache_url = url_string;
+    } else {
+      ps_start_proxy_fetch(r, ctx, cfg_s, url, url_string, driver);
+    }
   }
 
   // Set up a cleanup handler on the request.
@@ -1064,38 +1770,449 @@ ps_create_request_context(ngx_http_request_t* r, bool is_resource_fetch) {
   return CreateRequestContext::kOk;
 }
 
-// Send each buffer in the chain to the proxy_fetch for optimization.
-// Eventually it will make it's way, optimized, to base_fetch.
 void
-ps_send_to_pagespeed(ngx_http_request_t* r,
-                     ps_request_ctx_t* ctx,
-                     ps_srv_conf_t* cfg_s,
-                     ngx_chain_t* in) {
-  ngx_chain_t* cur;
-  int last_buf = 0;
-  for (cur = in; cur != NULL; cur = cur->next) {
-    last_buf = cur->buf->last_buf;
-
-    // Buffers are not really the last buffer until they've been through
-    // pagespeed.
-    cur->buf->last_buf = 0;
+ps_flush_to_pagespeed(ps_request_ctx_t* ctx, ps_srv_conf_t* cfg_s) {
+  if (ctx->flush_timer.timer_set) {
+    ngx_del_timer(&ctx->flush_timer);
+  }
+  ctx->proxy_fetch->Flush(cfg_s->handler);
+  ctx->unflushed_bytes = 0;
+  ctx->last_flush_msec = ngx_current_msec;
+  cfg_s->server_context->statistics()->GetVariable(
+      net_instaweb::NgxRewriteDriverFactory::kHtmlFlushes)->Add(1);
+}
 
-    CHECK(ctx->proxy_fetch != NULL);
-    ctx->proxy_fetch->Write(StringPiece(reinterpret_cast<char*>(cur->buf->pos),
-                                        cur->buf->last - cur->buf->pos),
-                            cfg_s->handler);
+// Decide whether to flush what we've written to proxy_fetch so far.  Each flush
+// ends a window filters can't rewrite across, so unless flush_now we wait for
+// more input until the oldest unflushed byte has waited flush_delay_ms.  Either
+// way we don't flush within min_flush_interval_ms of the last flush, and set a
+// timer to do it once we may.
+void
+ps_maybe_flush(ps_request_ctx_t* ctx, ps_srv_conf_t* cfg_s, bool flush_now) {
+  if (ctx->unflushed_bytes == 0) {
+    return;
+  }
 
-    // We're done with buffers as we pass them through, so mark them as sent as
-    // we go.
+  ngx_msec_t delay;
+  if (flush_now) {
+    ngx_msec_t since_last_flush = ngx_current_msec - ctx->last_flush_msec;
+    if (since_last_flush >= ctx->min_flush_interval_ms) {
+      ps_flush_to_pagespeed(ctx, cfg_s);
+      return;
+    }
+    delay = ctx->min_flush_interval_ms - since_last_flush;
+    if (ctx->flush_timer.timer_set &&
+        static_cast<ngx_msec_int_t>(ctx->flush_timer.timer.key -
+                                    (ngx_current_msec + delay)) <= 0) {
+      return;
+    }
+  } else if (ctx->flush_timer.timer_set) {
+    return;  // The waiting input already has a deadline.
+  } else {
+    delay = ctx->flush_delay_ms;
+  }
+
+  // ngx_add_timer replaces any timer already set.
+  ngx_add_timer(&ctx->flush_timer, delay);
+}
+
+void
+ps_flush_timer_handler(ngx_event_t* ev) {
+  ps_request_ctx_t* ctx = static_cast<ps_request_ctx_t*>(ev->data);
+  if (ctx->proxy_fetch != NULL && ctx->unflushed_bytes != 0) {
+    ps_flush_to_pagespeed(ctx, ps_get_srv_config(ctx->r));
+  }
+}
+
+// Inflates the gzipped upstream html in `in` onto the end of ctx->inflated
+// and marks the buffers consumed.  Sets last_buf if this was the end of the
+// response.  Returns false if the body isn't valid gzip.
+bool
+ps_inflate(ngx_http_request_t* r, ps_request_ctx_t* ctx, ngx_chain_t* in,
+           bool* last_buf) {
+  z_stream* stream = ctx->inflate_stream;
+  *last_buf = false;
+  for (ngx_chain_t* cl = in; cl != NULL; cl = cl->next) {
+    ngx_buf_t* b = cl->buf;
+    if (!ngx_buf_in_memory(b) && ngx_buf_size(b) != 0) {
+      // The header filter asks for html in memory, so this shouldn't happen.
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "pagespeed: gzipped html in a file buffer");
+      return false;
+    }
+
+    stream->next_in = b->pos;
+    stream->avail_in = b->last - b->pos;
+    // Keep going while there's input or zlib filled all the space we gave it,
+    // which can leave output it hasn't handed back yet.  Anything after the
+    // end of the gzip stream is ignored, as browsers do.
+    bool more = (stream->avail_in > 0);
+    while (!ctx->inflate_done && more) {
+      size_t old_size = ctx->inflated.size();
+      ctx->inflated.resize(old_size + kInflateChunkBytes);
+      stream->next_out = reinterpret_cast<Bytef*>(&ctx->inflated[old_size]);
+      stream->avail_out = kInflateChunkBytes;
+      int rc = inflate(stream, Z_NO_FLUSH);
+      more = (stream->avail_in > 0 || stream->avail_out == 0);
+      ctx->inflated.resize(old_size + kInflateChunkBytes - stream->avail_out);
+      if (rc == Z_STREAM_END) {
+        ctx->inflate_done = true;
+      } else if (rc == Z_BUF_ERROR) {
+        break;  // No progress possible until more input arrives.
+      } else if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "pagespeed: couldn't inflate upstream html: %d", rc);
+        return false;
+      }
+    }
+    // zlib keeps whatever it needs from the input between calls.
+    b->pos = b->last;
+
+    if (b->last_buf) {
+      *last_buf = true;
+    }
+  }
+  return true;
+}
+
+// A single buffer chain holding a copy of contents.  Returns NULL on
+// allocation failure.
+ngx_chain_t*
+ps_copy_to_chain(ngx_http_request_t* r, StringPiece contents, bool last_buf) {
+  ngx_buf_t* b = static_cast<ngx_buf_t*>(ngx_calloc_buf(r->pool));
+  ngx_chain_t* cl = static_cast<ngx_chain_t*>(ngx_alloc_chain_link(r->pool));
+  if (b == NULL || cl == NULL) {
+    return NULL;
+  }
+  if (contents.empty()) {
+    b->sync = 1;  // Only here to carry last_buf.
+  } else {
+    b->start = b->pos = static_cast<u_char*>(
+        ngx_pnalloc(r->pool, contents.size()));
+    if (b->pos == NULL) {
+      return NULL;
+    }
+    b->last = b->end = ngx_cpymem(b->pos, contents.data(), contents.size());
+    b->temporary = 1;
+  }
+  b->last_buf = last_buf;
+  cl->buf = b;
+  cl->next = NULL;
+  return cl;
+}
+
+// Stops the HtmlRewriteDeadlineMs timer and drops the copy of the original html
+// kept for it.
+void
+ps_cancel_rewrite_deadline(ps_request_ctx_t* ctx) {
+  if (ctx->deadline_timer.timer_set) {
+    ngx_del_timer(&ctx->deadline_timer);
+  }
+  ctx->keep_original_html = false;
+  GoogleString().swap(ctx->original_html);
+}
+
+// Pagespeed hasn't sent anything for this html response within
+// HtmlRewriteDeadlineMs.  Detach it from the request and send the html it was
+// given as is; ps_body_filter passes through whatever upstream sends after.
+// Rewrites pagespeed has already started keep going in the background and are
+// cached for later requests.
+void
+ps_deadline_timer_handler(ngx_event_t* ev) {
+  ps_request_ctx_t* ctx = static_cast<ps_request_ctx_t*>(ev->data);
+  ngx_http_request_t* r = ctx->r;
+  ngx_connection_t* c = r->connection;
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+  net_instaweb::Statistics* statistics = cfg_s->server_context->statistics();
+
+  // Html we're still collecting for the result cache is all in
+  // html_cache_input.  Once the lookup has taken it, our copy is in
+  // original_html like any other response's.
+  bool buffering_for_html_cache = ctx->html_cache_driver != NULL;
+  if (!ctx->keep_original_html && !buffering_for_html_cache) {
+    // The original was too big to keep.  At least don't hold back input
+    // pagespeed hasn't seen.
+    statistics->GetVariable(
+        net_instaweb::NgxRewriteDriverFactory::kHtmlDeadlinesMissed)->Add(1);
+    if (ctx->proxy_fetch != NULL && ctx->unflushed_bytes != 0) {
+      ps_flush_to_pagespeed(ctx, cfg_s);
+    }
+    return;
+  }
+
+  statistics->GetVariable(
+      net_instaweb::NgxRewriteDriverFactory::kHtmlDeadlinePassthroughs)->Add(1);
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                 "http pagespeed rewrite deadline passed \"%V\"", &r->uri);
+
+  if (ctx->flush_timer.timer_set) {
+    ngx_del_timer(&ctx->flush_timer);
+  }
+  if (ctx->proxy_fetch != NULL) {
+    ctx->proxy_fetch->Done(false /* failure */);
+    ctx->proxy_fetch = NULL;
+  }
+  if (ctx->html_cache_driver != NULL) {
+    // Still collecting the html to look up; see ps_release_request_context.
+    ctx->html_cache_driver->Cleanup();
+    ctx->html_cache_driver = NULL;
+    ctx->base_fetch->DecrefAndDeleteIfUnreferenced();
+  }
+  ctx->base_fetch->Release();
+  ctx->base_fetch = NULL;
+  ctx->deadline_passed = true;
+  ps_html_rewrite_finished(ctx, true /* completed */);
+
+  StringPiece original = buffering_for_html_cache
+      ? StringPiece(ctx->html_cache_input)
+      : StringPiece(ctx->original_html);
+  ngx_chain_t* out = NULL;
+  if (!original.empty() || ctx->input_done) {
+    out = ps_copy_to_chain(r, original, ctx->input_done);
+    if (out == NULL) {
+      ngx_http_finalize_request(r, NGX_ERROR);
+      return;
+    }
+  }
+  ctx->keep_original_html = false;
+  GoogleString().swap(ctx->original_html);
+
+  ps_set_buffered(r, false);
+  ngx_int_t rc = NGX_OK;
+  if (out != NULL) {
+    rc = ngx_http_next_body_filter(r, out);
+  }
+
+  if (rc == NGX_ERROR) {
+    ngx_http_finalize_request(r, NGX_ERROR);
+  } else if (ctx->input_done) {
+    // The response is complete, so finish up the way ps_base_fetch_handler
+    // does when pagespeed is done.
+    if (rc == NGX_AGAIN) {
+      if (ngx_http_set_pagespeed_write_handler(r) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      }
+    } else {
+      ngx_http_finalize_request(r, NGX_DONE);
+    }
+  }
+  ngx_http_run_posted_requests(c);
+}
+
+// Send each buffer in the chain to the proxy_fetch for optimization.
+// Looks for </head> in the next buffer of input, including where it starts in
+// an earlier buffer.
+bool
+ps_find_head_end(ps_request_ctx_t* ctx, u_char* pos, u_char* last) {
+  u_char* head_end = reinterpret_cast<u_char*>(const_cast<char*>("</head>"));
+  const size_t kTailLen = sizeof(ctx->head_end_tail);  // strlen("</head>") - 1
+  size_t size = last - pos;
+
+  // The end of the previous input followed by the start of this buffer.
+  u_char window[2 * kTailLen];
+  size_t window_len = ctx->head_end_tail_len + ngx_min(size, kTailLen);
+  ngx_memcpy(window, ctx->head_end_tail, ctx->head_end_tail_len);
+  ngx_memcpy(window + ctx->head_end_tail_len, pos,
+             window_len - ctx->head_end_tail_len);
+
+  if ((window_len > kTailLen &&
+       ngx_strlcasestrn(window, window + window_len, head_end,
+                        kTailLen) != NULL) ||
+      (size > kTailLen &&
+       ngx_strlcasestrn(pos, last, head_end, kTailLen) != NULL)) {
+    return true;
+  }
+
+  if (size >= kTailLen) {
+    ngx_memcpy(ctx->head_end_tail, last - kTailLen, kTailLen);
+    ctx->head_end_tail_len = kTailLen;
+  } else {
+    ctx->head_end_tail_len = ngx_min(window_len, kTailLen);
+    ngx_memcpy(ctx->head_end_tail, window + window_len - ctx->head_end_tail_len,
+               ctx->head_end_tail_len);
+  }
+  return false;
+}
+
+// Eventually it will make it's way, optimized, to base_fetch.
+void
+ps_send_to_pagespeed(ngx_http_request_t* r,
+                     ps_request_ctx_t* ctx,
+                     ps_srv_conf_t* cfg_s,
+                     ngx_chain_t* in) {
+  ngx_chain_t* cur;
+  int last_buf = 0;
+  bool flush_now = false;
+  for (cur = in; cur != NULL; cur = cur->next) {
+    last_buf = cur->buf->last_buf;
+
+    // Buffers are not really the last buffer until they've been through
+    // pagespeed.
+    cur->buf->last_buf = 0;
+
+    CHECK(ctx->proxy_fetch != NULL);
+    StringPiece contents(reinterpret_cast<char*>(cur->buf->pos),
+                         cur->buf->last - cur->buf->pos);
+    ctx->proxy_fetch->Write(contents, cfg_s->handler);
+    if (ctx->keep_original_html) {
+      if (ctx->original_html.size() + contents.size() <=
+          kMaxOriginalHtmlBytes) {
+        contents.AppendToString(&ctx->original_html);
+      } else {
+        ctx->keep_original_html = false;
+        GoogleString().swap(ctx->original_html);
+      }
+    }
+    ctx->unflushed_bytes += cur->buf->last - cur->buf->pos;
+
+    // Get the head out as soon as we can so the client can start fetching the
+    // resources it references.
+    if (!ctx->saw_head_end &&
+        ps_find_head_end(ctx, cur->buf->pos, cur->buf->last)) {
+      ctx->saw_head_end = true;
+      flush_now = true;
+    }
+
+    // We're done with buffers as we pass them through, so mark them as sent as
+    // we go.
     cur->buf->pos = cur->buf->last;
   }
 
   if (last_buf) {
+    ctx->input_done = true;
+    ctx->input_done_msec = ngx_current_msec;
+    if (ctx->flush_timer.timer_set) {
+      ngx_del_timer(&ctx->flush_timer);
+    }
     ctx->proxy_fetch->Done(true /* success */);
     ctx->proxy_fetch = NULL;  // ProxyFetch deletes itself on Done().
+    cfg_s->server_context->statistics()->GetVariable(
+        net_instaweb::NgxRewriteDriverFactory::kHtmlFlushedResponses)->Add(1);
   } else {
-    // TODO(jefftk): Decide whether Flush() is warranted here.
-    ctx->proxy_fetch->Flush(cfg_s->handler);
+    if (ctx->unflushed_bytes >= ctx->flush_buffer_bytes) {
+      flush_now = true;
+    }
+    ps_maybe_flush(ctx, cfg_s, flush_now);
+  }
+}
+
+// Collect the upstream html, and once we have all of it look for output we
+// already produced for it.  The lookup hands the driver and base fetch on to a
+// ProxyFetch if it misses.  Html too big to hold back from the client is
+// rewritten as it streams in instead, without the cache.
+void
+ps_buffer_for_html_cache(ngx_http_request_t* r,
+                         ps_request_ctx_t* ctx,
+                         ps_srv_conf_t* cfg_s,
+                         ngx_chain_t* in) {
+  bool last_buf = false;
+  for (ngx_chain_t* cl = in; cl != NULL; cl = cl->next) {
+    ngx_buf_t* b = cl->buf;
+    if (ctx->html_cache_input.size() + (b->last - b->pos) >
+        kMaxHtmlCacheInputBytes) {
+      net_instaweb::GoogleUrl url(ctx->html_cache_url);
+      GoogleString url_string;
+      url_string.swap(ctx->html_cache_url);
+      net_instaweb::RewriteDriver* driver = ctx->html_cache_driver;
+      ctx->html_cache_driver = NULL;
+      ps_start_proxy_fetch(r, ctx, cfg_s, url, url_string, driver);
+
+      ctx->proxy_fetch->Write(ctx->html_cache_input, cfg_s->handler);
+      ctx->unflushed_bytes += ctx->html_cache_input.size();
+      if (ctx->keep_original_html) {
+        // Fits, since kMaxOriginalHtmlBytes is no smaller.
+        ctx->original_html.swap(ctx->html_cache_input);
+      }
+      GoogleString().swap(ctx->html_cache_input);
+
+      ps_send_to_pagespeed(r, ctx, cfg_s, cl);
+      return;
+    }
+    ctx->html_cache_input.append(reinterpret_cast<char*>(b->pos),
+                                 b->last - b->pos);
+    b->pos = b->last;
+    last_buf = last_buf || b->last_buf;
+  }
+  if (!last_buf) {
+    return;
+  }
+  ctx->input_done = true;
+  ctx->input_done_msec = ngx_current_msec;
+
+  StringPiece user_agent;
+  if (r->headers_in.user_agent != NULL) {
+    user_agent = str_to_string_piece(r->headers_in.user_agent->value);
+  }
+
+  if (ctx->keep_original_html) {
+    // Lookup() takes html_cache_input, so keep a copy to send if the deadline
+    // passes before it's done.  Fits, since kMaxOriginalHtmlBytes is no
+    // smaller than kMaxHtmlCacheInputBytes.
+    ctx->original_html = ctx->html_cache_input;
+  }
+
+  net_instaweb::RewriteDriver* driver = ctx->html_cache_driver;
+  ctx->html_cache_driver = NULL;
+  net_instaweb::NgxHtmlResultCache::Lookup(
+      ctx->html_cache_url, &ctx->html_cache_input, user_agent,
+      ctx->html_cache_ttl_ms, driver, cfg_s->proxy_fetch_factory,
+      ctx->base_fetch, cfg_s->handler);
+}
+
+// After an in-place miss, start saving the response nginx serves so pagespeed
+// can optimize it for later requests.  Only successful, non-html responses are
+// worth it.
+void
+ps_in_place_start_recording(ngx_http_request_t* r,
+                            ps_request_ctx_t* ctx,
+                            ps_srv_conf_t* cfg_s) {
+  if (r != r->main || r->headers_out.status != NGX_HTTP_OK ||
+      ctx->recorder != NULL) {
+    return;
+  }
+  const net_instaweb::ContentType* content_type =
+      net_instaweb::MimeTypeToContentType(
+          str_to_string_piece(r->headers_out.content_type));
+  if (content_type == NULL || content_type->IsHtmlLike()) {
+    return;
+  }
+
+  ctx->recorder = new net_instaweb::InPlaceResourceRecorder(
+      ps_determine_url(r), cfg_s->server_context->http_cache(),
+      cfg_s->server_context->statistics(), cfg_s->handler);
+
+  // We need the bytes, so have static files read into memory instead of
+  // passed along as file buffers.
+  r->filter_need_in_memory = 1;
+}
+
+void
+ps_in_place_record(ngx_http_request_t* r,
+                   ps_request_ctx_t* ctx,
+                   ps_srv_conf_t* cfg_s,
+                   ngx_chain_t* in) {
+  for (ngx_chain_t* cl = in; cl != NULL; cl = cl->next) {
+    ngx_buf_t* b = cl->buf;
+    if (!ngx_buf_in_memory(b) && ngx_buf_size(b) != 0) {
+      // Some module upstream of us still handed over a file buffer; we can't
+      // record what we can't see.
+      delete ctx->recorder;
+      ctx->recorder = NULL;
+      return;
+    }
+
+    ctx->recorder->Write(
+        StringPiece(reinterpret_cast<char*>(b->pos), b->last - b->pos),
+        cfg_s->handler);
+
+    if (b->last_buf) {
+      net_instaweb::ResponseHeaders response_headers;
+      net_instaweb::NgxBaseFetch::CopyResponseHeaders(r, &response_headers);
+      // Deletes the recorder.
+      ctx->recorder->DoneAndSetHeaders(&response_headers);
+      ctx->recorder = NULL;
+      return;
+    }
   }
 }
 
@@ -1114,6 +2231,55 @@ ps_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
     return ngx_http_next_body_filter(r, in);
   }
 
+  // Stands in for in when we inflate it.
+  ngx_buf_t inflated_buf;
+  ngx_chain_t inflated_link;
+  if (ctx->inflate_stream != NULL && in != NULL) {
+    bool last_buf;
+    if (!ps_inflate(r, ctx, in, &last_buf)) {
+      return NGX_ERROR;
+    }
+    if (ctx->deadline_passed) {
+      // Going straight out, so it has to outlive ctx->inflated.
+      in = NULL;
+      if (!ctx->inflated.empty() || last_buf) {
+        in = ps_copy_to_chain(r, ctx->inflated, last_buf);
+        if (in == NULL) {
+          return NGX_ERROR;
+        }
+      }
+      ctx->inflated.clear();
+    } else if (!ctx->inflated.empty() || last_buf) {
+      // Pagespeed copies what it's given, so ctx->inflated can be reused as
+      // soon as we're done here.
+      ngx_memzero(&inflated_buf, sizeof(inflated_buf));
+      inflated_buf.pos = inflated_buf.start = reinterpret_cast<u_char*>(
+          const_cast<char*>(ctx->inflated.data()));
+      inflated_buf.last = inflated_buf.end =
+          inflated_buf.pos + ctx->inflated.size();
+      inflated_buf.temporary = 1;
+      inflated_buf.last_buf = last_buf;
+      inflated_link.buf = &inflated_buf;
+      inflated_link.next = NULL;
+      in = &inflated_link;
+    } else {
+      in = NULL;  // Nothing came out of this part of the stream.
+    }
+  }
+
+  if (ctx->deadline_passed) {
+    // Pagespeed took too long; the rest of the html goes out as it is.
+    return ngx_http_next_body_filter(r, in);
+  }
+
+  if (ctx->in_place_miss) {
+    // nginx is serving this resource itself; save a copy as it goes by.
+    if (ctx->recorder != NULL) {
+      ps_in_place_record(r, ctx, cfg_s, in);
+    }
+    return ngx_http_next_body_filter(r, in);
+  }
+
   // We don't want to handle requests with errors, but we should be dealing with
   // that in the header filter and not initializing ctx.
   CHECK(r->err_status == 0);
@@ -1131,10 +2297,19 @@ ps_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
     ctx->base_fetch->PopulateResponseHeaders();
   }
 
-  if (in != NULL) {
+  if (ctx->html_cache_driver != NULL) {
+    ps_buffer_for_html_cache(r, ctx, cfg_s, in);
+  } else if (in != NULL) {
     // Send all input data to the proxy fetch.
     ps_send_to_pagespeed(r, ctx, cfg_s, in);
+  } else {
+    // Upstream or ngx_http_writer found the client writable.  Push out what
+    // pagespeed has already given us so its segments can be recycled.
+    if (ngx_http_next_body_filter(r, NULL) == NGX_ERROR) {
+      return NGX_ERROR;
+    }
   }
+  ctx->inflated.clear();
 
   ps_set_buffered(r, true);
   return NGX_AGAIN;
@@ -1179,6 +2354,96 @@ ps_set_cache_control(ngx_http_request_t* r, char* cache_control) {
   return NGX_OK;
 }
 
+ps_html_load_t*
+ps_get_html_load(ngx_http_request_t* r) {
+  ps_main_conf_t* cfg_m = ps_get_main_config(r);
+  if (cfg_m->html_load == NULL) {
+    cfg_m->html_load = new ps_html_load_t();
+  }
+  return cfg_m->html_load;
+}
+
+// The 99th percentile of this worker's rewrite times from the last
+// kHtmlLoadWindowMs, or 0 if there are too few to tell.  Old times age out so
+// a worker that has been shedding everything gets to try again.
+ngx_msec_t
+ps_html_rewrite_p99_ms(ps_html_load_t* load) {
+  std::vector<ngx_msec_t> recent;
+  for (ngx_uint_t i = 0; i < load->num_samples; ++i) {
+    if (ngx_current_msec - load->finished_msec[i] <= kHtmlLoadWindowMs) {
+      recent.push_back(load->latency_ms[i]);
+    }
+  }
+  if (recent.size() < kHtmlLoadMinSamples) {
+    return 0;
+  }
+  std::vector<ngx_msec_t>::iterator p99 =
+      recent.begin() + recent.size() * 99 / 100;
+  std::nth_element(recent.begin(), p99, recent.end());
+  return *p99;
+}
+
+// Whether to pass this html response through unrewritten because this worker
+// is already doing as much rewriting as MaxHtmlRewritesInFlight and
+// MaxHtmlRewriteLatencyMs allow.
+bool
+ps_shed_html(ngx_http_request_t* r, ps_srv_conf_t* cfg_s) {
+  net_instaweb::NgxRewriteOptions* options = ps_get_loc_config(r)->options;
+  if (options == NULL) {
+    options = cfg_s->server_context->config();
+  }
+  int64 max_in_flight = options->max_html_rewrites_in_flight();
+  int64 max_latency_ms = options->max_html_rewrite_latency_ms();
+  if (!options->enabled() || (max_in_flight == 0 && max_latency_ms == 0)) {
+    return false;
+  }
+
+  ps_html_load_t* load = ps_get_html_load(r);
+  bool too_many = (max_in_flight > 0 &&
+                   load->in_flight >= static_cast<ngx_uint_t>(max_in_flight));
+  bool too_slow = (max_latency_ms > 0 &&
+                   ps_html_rewrite_p99_ms(load) >
+                   static_cast<ngx_msec_t>(max_latency_ms));
+  if (too_many || too_slow) {
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http pagespeed shedding \"%V\", %ui rewrites in flight",
+                   &r->uri, load->in_flight);
+    cfg_s->server_context->statistics()->GetVariable(
+        net_instaweb::NgxRewriteDriverFactory::kHtmlRewritesShed)->Add(1);
+    return true;
+  }
+  return false;
+}
+
+void
+ps_html_rewrite_started(ps_request_ctx_t* ctx) {
+  ++ps_get_html_load(ctx->r)->in_flight;
+  ctx->html_rewrite_counted = true;
+}
+
+// Stops counting ctx against the worker's limits.  Only rewrites that
+// completed tell us how long rewriting takes.  We measure from the last of the
+// upstream body, since until then pagespeed may just be waiting for input.
+void
+ps_html_rewrite_finished(ps_request_ctx_t* ctx, bool completed) {
+  if (!ctx->html_rewrite_counted) {
+    return;
+  }
+  ctx->html_rewrite_counted = false;
+
+  ps_html_load_t* load = ps_get_html_load(ctx->r);
+  --load->in_flight;
+  if (completed && ctx->input_done) {
+    load->finished_msec[load->next_sample] = ngx_current_msec;
+    load->latency_ms[load->next_sample] =
+        ngx_current_msec - ctx->input_done_msec;
+    load->next_sample = (load->next_sample + 1) % kHtmlLoadSamples;
+    if (load->num_samples < kHtmlLoadSamples) {
+      ++load->num_samples;
+    }
+  }
+}
+
 ngx_int_t
 ps_header_filter(ngx_http_request_t* r) {
   ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
@@ -1190,8 +2455,12 @@ ps_header_filter(ngx_http_request_t* r) {
   ps_request_ctx_t* ctx = ps_get_request_context(r);
 
   if (ctx != NULL) {
-    // ctx will already exist iff this is a pagespeed resource.  Do nothing.
+    // ctx will already exist iff this is a pagespeed resource or an in-place
+    // lookup.  Don't change anything, but record in-place misses.
     CHECK(ctx->is_resource_fetch);
+    if (ctx->in_place_miss) {
+      ps_in_place_start_recording(r, ctx, cfg_s);
+    }
     return ngx_http_next_header_filter(r);
   }
 
@@ -1209,6 +2478,26 @@ ps_header_filter(ngx_http_request_t* r) {
     return ngx_http_next_header_filter(r);
   }
 
+  // We can only rewrite html we can read.  Gzip we inflate as it arrives;
+  // anything else passes through.
+  bool gzipped = false;
+  if (r->headers_out.content_encoding != NULL &&
+      r->headers_out.content_encoding->value.len != 0) {
+    StringPiece encoding =
+        str_to_string_piece(r->headers_out.content_encoding->value);
+    if (net_instaweb::StringCaseEqual(encoding, "gzip") ||
+        net_instaweb::StringCaseEqual(encoding, "x-gzip")) {
+      gzipped = true;
+    } else if (!net_instaweb::StringCaseEqual(encoding, "identity")) {
+      return ngx_http_next_header_filter(r);
+    }
+  }
+
+  if (ps_shed_html(r, cfg_s)) {
+    // Without a ctx the body filter passes the html along untouched.
+    return ngx_http_next_header_filter(r);
+  }
+
   switch (ps_create_request_context(
       r, false /* not a resource fetch */)) {
     case CreateRequestContext::kError:
@@ -1229,6 +2518,27 @@ ps_header_filter(ngx_http_request_t* r) {
       break;
   }
 
+  ctx = ps_get_request_context(r);
+  ps_html_rewrite_started(ctx);
+  if (gzipped) {
+    ctx->inflate_stream = new z_stream;
+    ngx_memzero(ctx->inflate_stream, sizeof(z_stream));
+    // 16 more window bits accepts only a gzip wrapper.
+    if (inflateInit2(ctx->inflate_stream, MAX_WBITS + 16) != Z_OK) {
+      delete ctx->inflate_stream;
+      ctx->inflate_stream = NULL;
+      return NGX_ERROR;
+    }
+    // What we send is pagespeed's output, which nginx's gzip filter can
+    // compress again for the client.
+    r->headers_out.content_encoding->hash = 0;
+    r->headers_out.content_encoding = NULL;
+  }
+  if (ctx->rewrite_deadline_ms > 0 && !r->header_only) {
+    ctx->keep_original_html = true;
+    ngx_add_timer(&ctx->deadline_timer, ctx->rewrite_deadline_ms);
+  }
+
   // We're modifying content below, so switch to 'Transfer-Encoding: chunked'
   // and calculate on the fly.
   ngx_http_clear_content_length(r);
@@ -1261,6 +2571,73 @@ ps_header_filter(ngx_http_request_t* r) {
   return ngx_http_next_header_filter(r);
 }
 
+// Returns the asset for file_name, building it if this worker hasn't served it
+// before, or NULL if there's no such snippet.
+ps_static_asset_t*
+ps_get_static_asset(ps_srv_conf_t* cfg_s, StringPiece file_name) {
+  if (cfg_s->static_assets == NULL) {
+    cfg_s->static_assets = new ps_static_asset_map_t;
+  }
+  GoogleString key = file_name.as_string();
+  ps_static_asset_map_t::iterator iter = cfg_s->static_assets->find(key);
+  if (iter != cfg_s->static_assets->end()) {
+    return iter->second;
+  }
+
+  StringPiece file_contents;
+  StringPiece cache_header;
+  bool found = cfg_s->server_context->static_javascript_manager()->GetJsSnippet(
+      file_name, &file_contents, &cache_header);
+  if (!found) {
+    return NULL;
+  }
+
+  ps_static_asset_t* asset = new ps_static_asset_t;
+  file_contents.CopyToString(&asset->body);
+  cache_header.CopyToString(&asset->cache_control);
+  // The name already includes a hash of the contents.
+  asset->etag = net_instaweb::StrCat("\"", file_name, "\"");
+  // Best compression: it's only done once per worker.
+  if (!net_instaweb::NgxGzipResourceCache::Gzip(
+          asset->body, 9, &asset->gzipped_body) ||
+      asset->gzipped_body.size() >= asset->body.size()) {
+    asset->gzipped_body.clear();
+  }
+  (*cfg_s->static_assets)[key] = asset;
+  return asset;
+}
+
+// Whether the request has an If-None-Match that etag satisfies.
+bool
+ps_etag_matches(ngx_http_request_t* r, StringPiece etag) {
+  ngx_table_elt_t* if_none_match = ps_find_request_header(r, "If-None-Match");
+  if (if_none_match == NULL) {
+    return false;
+  }
+  StringPiece value = str_to_string_piece(if_none_match->value);
+  return (value == "*" || value.find(etag) != StringPiece::npos);
+}
+
+// Adds a response header pointing at value, which must outlive the request.
+ngx_table_elt_t*
+ps_add_static_header(ngx_http_request_t* r, const char* key,
+                     const GoogleString& value) {
+  ngx_table_elt_t* header = static_cast<ngx_table_elt_t*>(
+      ngx_list_push(&r->headers_out.headers));
+  if (header == NULL) {
+    return NULL;
+  }
+  header->hash = 1;
+  header->key.len = strlen(key);
+  header->key.data = reinterpret_cast<u_char*>(const_cast<char*>(key));
+  header->value.len = value.size();
+  header->value.data = reinterpret_cast<u_char*>(
+      const_cast<char*>(value.data()));
+  return header;
+}
+
+// Serves the snippet straight out of the worker's copy: the only per-request
+// allocations are header entries and one buffer pointing at the body.
 ngx_int_t
 ps_static_handler(ngx_http_request_t* r) {
   ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
@@ -1271,63 +2648,569 @@ ps_static_handler(ngx_http_request_t* r) {
   // StaticJavascriptManager.
   StringPiece file_name = request_uri_path.substr(
       strlen(net_instaweb::NgxRewriteDriverFactory::kStaticJavaScriptPrefix));
-  StringPiece file_contents;
-  StringPiece cache_header;
-  bool found = cfg_s->server_context->static_javascript_manager()->GetJsSnippet(
-      file_name, &file_contents, &cache_header);
-  if (!found) {
+  ps_static_asset_t* asset = ps_get_static_asset(cfg_s, file_name);
+  if (asset == NULL) {
     return NGX_DECLINED;
   }
 
-  // Set and send headers.
-  r->headers_out.status = NGX_HTTP_OK;
+  ngx_int_t rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  bool gzip = false;
+#if (NGX_HTTP_GZIP)
+  gzip = (!asset->gzipped_body.empty() && ngx_http_gzip_ok(r) == NGX_OK);
+#endif
+  const GoogleString& body = gzip ? asset->gzipped_body : asset->body;
 
-  // Content length
-  r->headers_out.content_length_n = file_contents.size();
   r->headers_out.content_type.len = sizeof("text/javascript") - 1;
   r->headers_out.content_type_len = r->headers_out.content_type.len;
   r->headers_out.content_type.data =
       reinterpret_cast<u_char*>(const_cast<char*>("text/javascript"));
   r->headers_out.content_type_lowcase = r->headers_out.content_type.data;
 
-  // Cache control
-  char* cache_control_s = string_piece_to_pool_string(r->pool, cache_header);
-  if (cache_control_s == NULL) {
+  if (ps_set_cache_control(
+          r, const_cast<char*>(asset->cache_control.c_str())) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  r->headers_out.etag = ps_add_static_header(r, "ETag", asset->etag);
+  if (r->headers_out.etag == NULL) {
     return NGX_ERROR;
   }
-  ps_set_cache_control(r, cache_control_s);
+  if (!asset->gzipped_body.empty()) {
+    static const GoogleString kAcceptEncoding = "Accept-Encoding";
+    if (ps_add_static_header(r, "Vary", kAcceptEncoding) == NULL) {
+      return NGX_ERROR;
+    }
+  }
 
-  ngx_http_send_header(r);
+  if (ps_etag_matches(r, asset->etag)) {
+    r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+    r->header_only = 1;
+    return ngx_http_send_header(r);
+  }
 
-  // Send the body.
-  ngx_chain_t* out;
-  ngx_int_t rc = string_piece_to_buffer_chain(
-      r->pool, file_contents, &out, true /* send_last_buf */);
-  if (rc == NGX_ERROR) {
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = body.size();
+  if (gzip) {
+    static const GoogleString kGzip = "gzip";
+    r->headers_out.content_encoding =
+        ps_add_static_header(r, "Content-Encoding", kGzip);
+    if (r->headers_out.content_encoding == NULL) {
+      return NGX_ERROR;
+    }
+  }
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  // Send the body.  Output filters move pos along as they go, so every request
+  // needs its own buffer, but the bytes themselves are shared.
+  ngx_buf_t* b = static_cast<ngx_buf_t*>(ngx_calloc_buf(r->pool));
+  if (b == NULL) {
     return NGX_ERROR;
   }
-  CHECK(rc == NGX_OK);
+  b->start = b->pos = reinterpret_cast<u_char*>(const_cast<char*>(body.data()));
+  b->end = b->last = b->pos + body.size();
+  b->memory = body.empty() ? 0 : 1;
+  b->last_buf = 1;
 
-  return ngx_http_output_filter(r, out);
+  ngx_chain_t out;
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
 }
 
-// Handle requests for resources like example.css.pagespeed.ce.LyfcM6Wulf.css
-// and for static content like /ngx_pagespeed_static/js_defer.q1EBmcgYOC.js
+// Whether a conditional request is satisfied by the cached response headers:
+// If-None-Match by its ETag, or, without If-None-Match, If-Modified-Since by
+// its Last-Modified.
+bool
+ps_not_modified(ngx_http_request_t* r,
+                const net_instaweb::ResponseHeaders& headers) {
+  if (ps_find_request_header(r, "If-None-Match") != NULL) {
+    const char* etag = headers.Lookup1(net_instaweb::HttpAttributes::kEtag);
+    return etag != NULL && ps_etag_matches(r, etag);
+  }
+  if (r->headers_in.if_modified_since == NULL) {
+    return false;
+  }
+  const char* last_modified =
+      headers.Lookup1(net_instaweb::HttpAttributes::kLastModified);
+  if (last_modified == NULL) {
+    return false;
+  }
+  time_t modified = ngx_http_parse_time(
+      reinterpret_cast<u_char*>(const_cast<char*>(last_modified)),
+      strlen(last_modified));
+  time_t since = ngx_http_parse_time(
+      r->headers_in.if_modified_since->value.data,
+      r->headers_in.if_modified_since->value.len);
+  return modified != NGX_ERROR && since != NGX_ERROR && modified <= since;
+}
+
+// Answers a revalidation with the validators and caching headers of the
+// cached response, as a 200 would have carried them.
 ngx_int_t
-ps_content_handler(ngx_http_request_t* r) {
+ps_send_not_modified(ngx_http_request_t* r,
+                     const net_instaweb::ResponseHeaders& headers) {
+  static const char* kKeptHeaders[] = {
+    net_instaweb::HttpAttributes::kCacheControl,
+    net_instaweb::HttpAttributes::kEtag,
+    net_instaweb::HttpAttributes::kExpires,
+    net_instaweb::HttpAttributes::kLastModified,
+    net_instaweb::HttpAttributes::kVary,
+  };
+  net_instaweb::ResponseHeaders not_modified;
+  not_modified.set_status_code(net_instaweb::HttpStatus::kNotModified);
+  for (size_t i = 0; i < arraysize(kKeptHeaders); ++i) {
+    net_instaweb::ConstStringStarVector values;
+    if (headers.Lookup(kKeptHeaders[i], &values)) {
+      for (size_t j = 0; j < values.size(); ++j) {
+        not_modified.Add(kKeptHeaders[i], *values[j]);
+      }
+    }
+  }
+
+  if (net_instaweb::NgxBaseFetch::CopyHeadersToRequest(not_modified, r) !=
+      NGX_OK) {
+    return NGX_ERROR;
+  }
+  r->header_only = 1;
+  return ngx_http_send_header(r);
+}
+
+// Serves a .pagespeed. resource straight from its file cache entry, letting
+// nginx send the body with sendfile and skipping the rewrite threads entirely.
+// Conditional requests the entry satisfies get a 304.  Returns NGX_DECLINED to
+// fall back to a ResourceFetch whenever this can't be done: the resource isn't
+// in the file cache, its entry doesn't hold together, it's stale, it isn't a
+// plain 200, or the request could change options.
+ngx_int_t
+ps_serve_from_file_cache(ngx_http_request_t* r, ps_srv_conf_t* cfg_s) {
+  if (r != r->main || !ps_may_be_pagespeed_resource(r) ||
+      ps_request_may_set_options(r)) {
+    return NGX_DECLINED;
+  }
+
+  net_instaweb::NgxRewriteOptions* options = ps_get_loc_config(r)->options;
+  if (options == NULL) {
+    options = cfg_s->server_context->config();
+  }
+  if (!options->enabled() || options->file_cache_path().empty()) {
+    return NGX_DECLINED;
+  }
+
+  GoogleString url_string = ps_determine_url(r);
+  net_instaweb::GoogleUrl url(url_string);
+  if (!url.is_valid() || !cfg_s->server_context->IsPagespeedResource(url)) {
+    return NGX_DECLINED;
+  }
+
+  // Clients that take gzip get the variant NgxGzipResourceCache keeps, and
+  // only that: if it isn't there the gzip lookup makes it.
+  GoogleString key = url_string;
+#if (NGX_HTTP_GZIP)
+  if (options->gzip_resource_level() > 0 && ngx_http_gzip_ok(r) == NGX_OK) {
+    key = net_instaweb::NgxGzipResourceCache::VariantKey(
+        url_string, options->gzip_resource_level());
+  }
+#endif
+
+  // Where FileCache keeps the http cache's entry for this key.
+  GoogleString prefix = options->file_cache_path();
+  net_instaweb::EnsureEndsInSlash(&prefix);
+  GoogleString filename;
+  ps_get_main_config(r)->driver_factory->filename_encoder()->Encode(
+      prefix, key, &filename);
+
+  ngx_str_t path;
+  path.len = filename.size();
+  path.data = reinterpret_cast<u_char*>(
+      string_piece_to_pool_string(r->pool, filename));
+  if (path.data == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_http_core_loc_conf_t* clcf = static_cast<ngx_http_core_loc_conf_t*>(
+      ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+  ngx_open_file_info_t of;
+  ngx_memzero(&of, sizeof(of));
+  of.read_ahead = clcf->read_ahead;
+  of.directio = clcf->directio;
+  of.valid = clcf->open_file_cache_valid;
+  of.min_uses = clcf->open_file_cache_min_uses;
+  of.errors = clcf->open_file_cache_errors;
+  of.events = clcf->open_file_cache_events;
+  if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) !=
+      NGX_OK || !of.is_file) {
+    return NGX_DECLINED;
+  }
+
+  // The entry is a serialized HTTPValue: 'h' if the headers come first or 'b'
+  // if the body does, the size of that first part as a 32-bit int, the first
+  // part, then the second.  FileCache adds no version or checksum of its own,
+  // so nothing here is trusted until the sizes agree with the file and the
+  // headers parse and agree with the body.  These reads block the worker, so
+  // the usual headers-first entry takes just one, of a bounded size.
+  ngx_file_t file;
+  ngx_memzero(&file, sizeof(file));
+  file.fd = of.fd;
+  file.name = path;
+  file.log = r->connection->log;
+
+  const off_t kPrefixSize = 1 + sizeof(uint32);
+  if (of.size < kPrefixSize) {
+    return NGX_DECLINED;
+  }
+  size_t head_size = std::min(of.size, kPrefixSize + kMaxFileCacheHeadersBytes);
+  u_char* head = static_cast<u_char*>(ngx_pnalloc(r->pool, head_size));
+  if (head == NULL) {
+    return NGX_ERROR;
+  }
+  if (ngx_read_file(&file, head, head_size, 0) !=
+      static_cast<ssize_t>(head_size)) {
+    return NGX_DECLINED;
+  }
+  uint32 first_size;
+  ngx_memcpy(&first_size, head + 1, sizeof(first_size));
+  if (first_size > of.size - kPrefixSize) {
+    return NGX_DECLINED;
+  }
+  off_t headers_start, headers_end, body_start, body_end;
+  if (head[0] == 'h') {
+    headers_start = kPrefixSize;
+    headers_end = body_start = kPrefixSize + first_size;
+    body_end = of.size;
+  } else if (head[0] == 'b') {
+    body_start = kPrefixSize;
+    body_end = headers_start = kPrefixSize + first_size;
+    headers_end = of.size;
+  } else {
+    return NGX_DECLINED;
+  }
+
+  off_t headers_size = headers_end - headers_start;
+  if (headers_size <= 0 || headers_size > kMaxFileCacheHeadersBytes) {
+    return NGX_DECLINED;
+  }
+  GoogleString headers_bytes;
+  if (headers_end <= static_cast<off_t>(head_size)) {
+    headers_bytes.assign(reinterpret_cast<char*>(head + headers_start),
+                         headers_size);
+  } else {
+    headers_bytes.resize(headers_size);
+    if (ngx_read_file(&file, reinterpret_cast<u_char*>(&headers_bytes[0]),
+                      headers_size, headers_start) != headers_size) {
+      return NGX_DECLINED;
+    }
+  }
+  net_instaweb::ResponseHeaders headers;
+  int64 content_length;
+  if (!headers.ReadFromBinary(headers_bytes, cfg_s->handler) ||
+      headers.status_code() != net_instaweb::HttpStatus::kOK ||
+      (headers.FindContentLength(&content_length) &&
+       content_length != body_end - body_start) ||
+      headers.CacheExpirationTimeMs() <=
+      cfg_s->server_context->timer()->NowMs()) {
+    return NGX_DECLINED;
+  }
+
+  ngx_int_t rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  if (ps_not_modified(r, headers)) {
+    return ps_send_not_modified(r, headers);
+  }
+
+  if (net_instaweb::NgxBaseFetch::CopyHeadersToRequest(headers, r) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ngx_http_clear_content_length(r);
+  r->headers_out.content_length_n = body_end - body_start;
+  r->allow_ranges = 1;
+
+  cfg_s->server_context->statistics()->GetVariable(
+      net_instaweb::NgxRewriteDriverFactory::kResourceFileCacheHits)->Add(1);
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  ngx_buf_t* b = static_cast<ngx_buf_t*>(ngx_calloc_buf(r->pool));
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+  b->file = static_cast<ngx_file_t*>(ngx_pcalloc(r->pool, sizeof(ngx_file_t)));
+  if (b->file == NULL) {
+    return NGX_ERROR;
+  }
+  b->file_pos = body_start;
+  b->file_last = body_end;
+  b->in_file = (body_end > body_start) ? 1 : 0;
+  b->last_buf = 1;
+  b->last_in_chain = 1;
+  b->file->fd = of.fd;
+  b->file->name = path;
+  b->file->log = r->connection->log;
+  b->file->directio = of.is_directio;
+
+  ngx_chain_t out;
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
+}
+
+// Request coalescing.  Right after a deploy many clients ask for the same
+// not yet cached .pagespeed. resource at once, and each would start its own
+// ResourceFetch: the same origin fetch and the same image recompression, over
+// and over.  Instead the first request for a url claims it in a table shared
+// by all workers and fetches as usual.  Requests that find the url claimed
+// wait, up to CoalesceWaitMs, for the claim to go away and then start over,
+// which normally finds the leader's result in the file or http cache.
+
+ngx_int_t
+ps_coalesce_init_zone(ngx_shm_zone_t* zone, void* data) {
+  if (data != NULL) {
+    // Reloading.  Keep the table; claims from the old workers expire.
+    zone->data = data;
+    return NGX_OK;
+  }
+
+  ngx_slab_pool_t* shpool = reinterpret_cast<ngx_slab_pool_t*>(zone->shm.addr);
+  size_t size = kCoalesceSlots * sizeof(ps_coalesce_slot_t);
+  void* slots = ngx_slab_alloc(shpool, size);
+  if (slots == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(slots, size);
+  zone->data = slots;
+  return NGX_OK;
+}
+
+// Shared between processes, so ngx_current_msec won't do.
+ngx_atomic_uint_t
+ps_coalesce_now_ms() {
+  ngx_time_t* tp = ngx_timeofday();
+  return static_cast<ngx_atomic_uint_t>(tp->sec) * 1000 + tp->msec;
+}
+
+bool
+ps_coalesce_expired(ngx_atomic_uint_t deadline_ms, ngx_atomic_uint_t now_ms) {
+  return static_cast<ngx_atomic_int_t>(deadline_ms - now_ms) <= 0;
+}
+
+// Returns NGX_BUSY, with slot set to its claim, if some request is already
+// fetching key.  Otherwise claims key for this request and returns NGX_OK,
+// with slot set to the claim or NULL if the table was too full for one.
+ngx_int_t
+ps_coalesce_claim(ps_coalesce_slot_t* slots, ngx_atomic_uint_t key,
+                  ngx_msec_t wait_ms, ps_coalesce_slot_t** slot) {
+  ngx_atomic_uint_t now_ms = ps_coalesce_now_ms();
+  ngx_uint_t home = key % kCoalesceSlots;
+
+  for (ngx_uint_t i = 0; i < kCoalesceProbes; ++i) {
+    ps_coalesce_slot_t* candidate = &slots[(home + i) % kCoalesceSlots];
+    if (candidate->key == key &&
+        !ps_coalesce_expired(candidate->deadline_ms, now_ms)) {
+      *slot = candidate;
+      return NGX_BUSY;
+    }
+  }
+
+  for (ngx_uint_t i = 0; i < kCoalesceProbes; ++i) {
+    ps_coalesce_slot_t* candidate = &slots[(home + i) % kCoalesceSlots];
+    ngx_atomic_uint_t old_key = candidate->key;
+    if ((old_key == 0 ||
+         ps_coalesce_expired(candidate->deadline_ms, now_ms)) &&
+        ngx_atomic_cmp_set(&candidate->key, old_key, key)) {
+      // Another worker could see the old deadline before we replace it and
+      // claim the slot as well.  Then the url is fetched twice, as it would
+      // have been without coalescing.
+      candidate->deadline_ms = now_ms + wait_ms;
+      *slot = candidate;
+      return NGX_OK;
+    }
+  }
+
+  *slot = NULL;
+  return NGX_OK;
+}
+
+void
+ps_coalesce_release(ps_request_ctx_t* ctx) {
+  if (ctx->coalesce_slot != NULL) {
+    // If our claim expired someone else may own the slot now; leave theirs.
+    ngx_atomic_cmp_set(&ctx->coalesce_slot->key, ctx->coalesce_key, 0);
+    ctx->coalesce_slot = NULL;
+  }
+}
+
+// A request waiting for another to fetch its url.
+typedef struct {
+  ngx_http_request_t* r;
+  ps_coalesce_slot_t* slot;
+  ngx_atomic_uint_t key;
+  ngx_msec_t give_up_msec;
+  ngx_event_t timer;
+} ps_coalesce_wait_t;
+
+ngx_int_t
+ps_resource_handler(ngx_http_request_t* r, ps_srv_conf_t* cfg_s,
+                    bool may_coalesce);
+
+void
+ps_coalesce_wait_cleanup(void* data) {
+  ps_coalesce_wait_t* wait = static_cast<ps_coalesce_wait_t*>(data);
+  if (wait->timer.timer_set) {
+    ngx_del_timer(&wait->timer);
+  }
+}
+
+void
+ps_coalesce_timer_handler(ngx_event_t* ev) {
+  ps_coalesce_wait_t* wait = static_cast<ps_coalesce_wait_t*>(ev->data);
+  ngx_http_request_t* r = wait->r;
+  ngx_connection_t* c = r->connection;
   ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
-  if (cfg_s->server_context == NULL) {
-    // Pagespeed is on for some server block but not this one.
+
+  bool in_flight =
+      wait->slot->key == wait->key &&
+      !ps_coalesce_expired(wait->slot->deadline_ms, ps_coalesce_now_ms());
+  bool timed_out =
+      static_cast<ngx_msec_int_t>(ngx_current_msec - wait->give_up_msec) >= 0;
+  if (in_flight && !timed_out) {
+    ngx_add_timer(&wait->timer, kCoalescePollMs);
+    return;
+  }
+  if (in_flight) {
+    cfg_s->server_context->statistics()->GetVariable(
+        net_instaweb::NgxRewriteDriverFactory::kCoalesceTimeouts)->Add(1);
+  }
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                 "http pagespeed coalesced request resuming \"%V\"", &r->uri);
+
+  // Picks up where ps_content_handler left off, which took the url as one of
+  // ours; declining now would leave the request with nowhere to go.
+  ngx_int_t rc = ps_resource_handler(r, cfg_s, false /* may_coalesce */);
+  if (rc == NGX_DECLINED) {
+    rc = NGX_HTTP_NOT_FOUND;
+  }
+  ngx_http_finalize_request(r, rc);
+  ngx_http_run_posted_requests(c);
+}
+
+// Decides whether a request for a .pagespeed. resource should wait for an
+// identical one in flight.  Returns NGX_DONE if it's now waiting, NGX_ERROR,
+// or NGX_DECLINED to go ahead and fetch, with slot and key set if this
+// request claimed the url for others to wait on.
+ngx_int_t
+ps_coalesce(ngx_http_request_t* r, ps_srv_conf_t* cfg_s,
+            ps_coalesce_slot_t** slot, ngx_atomic_uint_t* key) {
+  *slot = NULL;
+  *key = 0;
+
+  ps_main_conf_t* cfg_m = ps_get_main_config(r);
+  if (r != r->main || cfg_m->coalesce_zone == NULL ||
+      cfg_m->coalesce_zone->data == NULL ||
+      !ps_may_be_pagespeed_resource(r)) {
     return NGX_DECLINED;
   }
 
-  // TODO(jefftk): return NGX_DECLINED for non-get non-head requests.
+  net_instaweb::NgxRewriteOptions* options = ps_get_loc_config(r)->options;
+  if (options == NULL) {
+    options = cfg_s->server_context->config();
+  }
+  ngx_msec_t wait_ms = options->coalesce_wait_ms();
+  if (wait_ms == 0 || !options->enabled()) {
+    return NGX_DECLINED;
+  }
 
-  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                 "http pagespeed handler \"%V\"", &r->uri);
+  GoogleString url_string = ps_determine_url(r);
+  net_instaweb::GoogleUrl url(url_string);
+  if (!url.is_valid() || !cfg_s->server_context->IsPagespeedResource(url)) {
+    return NGX_DECLINED;
+  }
 
-  switch (ps_create_request_context(
-      r, true /* is a resource fetch */)) {
+  ngx_atomic_uint_t url_key = ngx_crc32_long(
+      reinterpret_cast<u_char*>(const_cast<char*>(url_string.data())),
+      url_string.size());
+  if (url_key == 0) {
+    url_key = 1;  // 0 marks a free slot.
+  }
+
+  ps_coalesce_slot_t* slots =
+      static_cast<ps_coalesce_slot_t*>(cfg_m->coalesce_zone->data);
+  ps_coalesce_slot_t* claim;
+  if (ps_coalesce_claim(slots, url_key, wait_ms, &claim) == NGX_OK) {
+    *slot = claim;
+    *key = url_key;
+    return NGX_DECLINED;
+  }
+
+  ps_coalesce_wait_t* wait = static_cast<ps_coalesce_wait_t*>(
+      ngx_pcalloc(r->pool, sizeof(ps_coalesce_wait_t)));
+  if (wait == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_pool_cleanup_t* cleanup = ngx_pool_cleanup_add(r->pool, 0);
+  if (cleanup == NULL) {
+    return NGX_ERROR;
+  }
+  cleanup->handler = ps_coalesce_wait_cleanup;
+  cleanup->data = wait;
+
+  wait->r = r;
+  wait->slot = claim;
+  wait->key = url_key;
+  wait->give_up_msec = ngx_current_msec + wait_ms;
+  wait->timer.handler = ps_coalesce_timer_handler;
+  wait->timer.data = wait;
+  wait->timer.log = r->connection->log;
+  ngx_add_timer(&wait->timer, kCoalescePollMs);
+
+  cfg_s->server_context->statistics()->GetVariable(
+      net_instaweb::NgxRewriteDriverFactory::kCoalescedFetches)->Add(1);
+
+  // Suspend the phase engine until ps_coalesce_timer_handler.
+  r->main->count++;
+  return NGX_DONE;
+}
+
+// Serves a .pagespeed. resource or static snippet, from the file cache if we
+// can and otherwise with a ResourceFetch.  Returns NGX_DECLINED for anything
+// that isn't ours.
+ngx_int_t
+ps_resource_handler(ngx_http_request_t* r, ps_srv_conf_t* cfg_s,
+                    bool may_coalesce) {
+  ngx_int_t rc = ps_serve_from_file_cache(r, cfg_s);
+  if (rc != NGX_DECLINED) {
+    return rc;
+  }
+
+  ps_coalesce_slot_t* coalesce_slot = NULL;
+  ngx_atomic_uint_t coalesce_key = 0;
+  if (may_coalesce) {
+    rc = ps_coalesce(r, cfg_s, &coalesce_slot, &coalesce_key);
+    if (rc != NGX_DECLINED) {
+      return rc;
+    }
+  }
+
+  CreateRequestContext::Response response = ps_create_request_context(
+      r, true /* is a resource fetch */);
+  if (response != CreateRequestContext::kOk && coalesce_slot != NULL) {
+    // Nothing to wait for after all.
+    ngx_atomic_cmp_set(&coalesce_slot->key, coalesce_key, 0);
+  }
+
+  switch (response) {
     case CreateRequestContext::kError:
       return NGX_ERROR;
     case CreateRequestContext::kNotUnderstood:
@@ -1343,6 +3226,8 @@ ps_content_handler(ngx_http_request_t* r) {
   ps_request_ctx_t* ctx =
       ps_get_request_context(r);
   CHECK(ctx != NULL);
+  ctx->coalesce_slot = coalesce_slot;
+  ctx->coalesce_key = coalesce_key;
 
   // Tell nginx we're still working on this one.
   r->count++;
@@ -1350,6 +3235,158 @@ ps_content_handler(ngx_http_request_t* r) {
   return NGX_DONE;
 }
 
+// Handle requests for resources like example.css.pagespeed.ce.LyfcM6Wulf.css
+// and for static content like /ngx_pagespeed_static/js_defer.q1EBmcgYOC.js
+ngx_int_t
+ps_content_handler(ngx_http_request_t* r) {
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+  if (cfg_s->server_context == NULL) {
+    // Pagespeed is on for some server block but not this one.
+    return NGX_DECLINED;
+  }
+
+  if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    return NGX_DECLINED;
+  }
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "http pagespeed handler \"%V\"", &r->uri);
+
+  return ps_resource_handler(r, cfg_s, true /* may_coalesce */);
+}
+
+// In-place resource optimization: before nginx serves a css, javascript, or
+// image file itself, whether from disk or from upstream, see if pagespeed has
+// an optimized version cached.  Runs as the last access phase handler, after
+// allow/deny, auth_basic, auth_request and the like, because with proxy_pass
+// and similar the location's handler replaces the content phase handlers.  On
+// a hit we serve the cached version like a .pagespeed. resource; on a miss
+// ps_in_place_miss resumes nginx's normal handling.
+ngx_int_t
+ps_in_place_handler(ngx_http_request_t* r) {
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+  if (cfg_s->server_context == NULL) {
+    // Pagespeed is on for some server block but not this one.
+    return NGX_DECLINED;
+  }
+
+  if (r->access_code != 0) {
+    // With "satisfy any" a module has denied access, which nginx enforces once
+    // the access phase is over unless a later module allows it.  We're last,
+    // so that's going to happen.
+    return NGX_DECLINED;
+  }
+
+  if (r != r->main || r->method != NGX_HTTP_GET) {
+    return NGX_DECLINED;
+  }
+
+  ps_request_ctx_t* existing_ctx = ps_get_request_context(r);
+  if (existing_ctx != NULL) {
+    // Run again before our lookup finished: stay suspended rather than let
+    // nginx start serving the request underneath it.
+    return existing_ctx->in_place_check ? NGX_AGAIN : NGX_DECLINED;
+  }
+
+  ps_loc_conf_t* cfg_l = ps_get_loc_config(r);
+  net_instaweb::RewriteOptions* options;
+  net_instaweb::RewriteDriverPool* driver_pool;
+  if (cfg_l->options != NULL) {
+    options = cfg_l->options;
+    driver_pool = cfg_l->driver_pools->pool();
+  } else {
+    options = cfg_s->server_context->global_options();
+    driver_pool = NULL;
+  }
+  if (!options->enabled() || !options->in_place_rewriting_enabled()) {
+    return NGX_DECLINED;
+  }
+
+  // Don't spend a cache lookup on html or anything else we wouldn't optimize.
+  // .pagespeed. resources are for ps_content_handler.
+  const net_instaweb::ContentType* content_type =
+      net_instaweb::NameExtensionToContentType(str_to_string_piece(r->uri));
+  if (content_type == NULL ||
+      !(content_type->IsCss() || content_type->IsJs() ||
+        content_type->IsImage()) ||
+      ps_may_be_pagespeed_resource(r)) {
+    return NGX_DECLINED;
+  }
+
+  net_instaweb::GoogleUrl url(ps_determine_url(r));
+  if (!url.is_valid()) {
+    return NGX_DECLINED;
+  }
+
+  ps_request_ctx_t* ctx = new ps_request_ctx_t();
+  ctx->r = r;
+  ctx->is_resource_fetch = true;
+  ctx->write_pending = false;
+  ctx->in_place_check = true;
+
+  ngx_http_cleanup_t* cleanup = ngx_http_cleanup_add(r, 0);
+  if (cleanup == NULL) {
+    delete ctx;
+    return NGX_ERROR;
+  }
+  cleanup->handler = ps_release_request_context;
+  cleanup->data = ctx;
+  ngx_http_set_ctx(r, ctx, ngx_pagespeed);
+
+  ctx->base_fetch = new net_instaweb::NgxBaseFetch(
+      r, ps_get_main_config(r)->fetch_queue);
+  ctx->base_fetch->PopulateRequestHeaders();
+  net_instaweb::NgxRewriteOptions* ngx_options =
+      net_instaweb::NgxRewriteOptions::DynamicCast(options);
+  ctx->base_fetch->set_segment_size(output_buffer_size(r, ngx_options));
+  if (ngx_options != NULL) {
+    ctx->base_fetch->set_max_buffered_bytes(
+        ngx_options->max_buffered_output_bytes());
+    ctx->base_fetch->set_max_worker_buffered_bytes(
+        ngx_options->max_worker_buffered_output_bytes());
+    ctx->base_fetch->set_max_spill_bytes(
+        ngx_options->max_spilled_output_bytes());
+  }
+
+  net_instaweb::RewriteDriver* driver;
+  if (driver_pool != NULL) {
+    driver = cfg_s->server_context->NewRewriteDriverFromPool(driver_pool);
+  } else {
+    driver = cfg_s->server_context->NewRewriteDriver();
+  }
+  driver->set_log_record(ctx->base_fetch->log_record());
+
+  // Released in NgxBaseFetch::HandleDone().
+  ctx->base_fetch->IncrementRefCount();
+  driver->FetchInPlaceResource(url, false /* proxy_mode */, ctx->base_fetch);
+
+  // Suspend the phase engine until we know whether the cache had it.  Write
+  // events in the meantime mustn't run the phases again; ps_in_place_miss
+  // restores ngx_http_core_run_phases.
+  r->write_event_handler = ngx_http_request_empty_handler;
+  r->main->count++;
+  return NGX_DONE;
+}
+
+// The cache didn't have an optimized version of this resource.  Stop
+// listening to the in-place fetch and let nginx serve the request the way it
+// would have without us, picking up the phases after ps_in_place_handler.
+void
+ps_in_place_miss(ps_request_ctx_t* ctx) {
+  ngx_http_request_t* r = ctx->r;
+  ngx_connection_t* c = r->connection;
+
+  ctx->in_place_miss = true;
+  ctx->base_fetch->Release();
+  ctx->base_fetch = NULL;
+
+  r->main->count--;
+  r->phase_handler++;
+  r->write_event_handler = ngx_http_core_run_phases;
+  ngx_http_core_run_phases(r);
+  ngx_http_run_posted_requests(c);
+}
+
 ngx_int_t
 ps_init(ngx_conf_t* cf) {
   // Only put register pagespeed code to run if there was a "pagespeed"
@@ -1381,11 +3418,41 @@ ps_init(ngx_conf_t* cf) {
       return NGX_ERROR;
     }
     *h = ps_content_handler;
+
+    // Access phase handlers run in the reverse of the order they're added.
+    // Put ours at the front so it runs after every other module's checks.
+    ngx_array_t* access_handlers =
+        &cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers;
+    if (ngx_array_push(access_handlers) == NULL) {
+      return NGX_ERROR;
+    }
+    h = static_cast<ngx_http_handler_pt*>(access_handlers->elts);
+    ngx_memmove(h + 1, h,
+                (access_handlers->nelts - 1) * sizeof(ngx_http_handler_pt));
+    *h = ps_in_place_handler;
   }
 
   return NGX_OK;
 }
 
+// Set up the fetch queue rewrite threads use to wake this worker, and point the
+// native fetchers at it.  Runs once in each worker process, after the fork.
+ngx_int_t
+ps_init_child_process(ngx_cycle_t* cycle) {
+  ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
+      ngx_http_cycle_get_module_main_conf(cycle, ngx_pagespeed));
+  if (cfg_m == NULL || cfg_m->driver_factory == NULL) {
+    return NGX_OK;  // No pagespeed configuration.
+  }
+
+  cfg_m->fetch_queue = new net_instaweb::NgxFetchQueue(ps_base_fetch_handler);
+  if (cfg_m->fetch_queue->Init(cycle->log) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  cfg_m->driver_factory->InitNgxFetchers(cfg_m->fetch_queue, cycle->log);
+  return NGX_OK;
+}
+
 ngx_http_module_t ps_module = {
   NULL,  // preconfiguration
   ps_init,  // postconfiguration
@@ -1411,7 +3478,7 @@ ngx_module_t ngx_pagespeed = {
   NGX_HTTP_MODULE,
   NULL,
   NULL,
-  NULL,
+  ngx_psol::ps_init_child_process,
   NULL,
   NULL,
   NULL,
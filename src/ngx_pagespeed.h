@@ -21,6 +21,7 @@
 
 extern "C" {
   #include <ngx_core.h>
+  #include <ngx_http.h>
 }
 
 #include "net/instaweb/util/public/string_util.h"
@@ -29,10 +30,19 @@ namespace ngx_psol {
 
 // Allocate chain links and buffers from the supplied pool, and copy over the
 // data from the string piece.  If the string piece is empty, return
-// NGX_DECLINED immediately unless send_last_buf.
+// NGX_DECLINED immediately unless send_last_buf.  Data that fits in
+// max_buffer_size goes out as a single exactly-sized buffer; larger data is
+// split into max_buffer_size chunks.
 ngx_int_t
 string_piece_to_buffer_chain(ngx_pool_t* pool, StringPiece sp,
-                             ngx_chain_t** link_ptr, bool send_last_buf);
+                             ngx_chain_t** link_ptr, bool send_last_buf,
+                             size_t max_buffer_size);
+
+// How much output the location serving r is set up to buffer on its way to
+// the client, based on its output_buffers and postpone_output settings.  Use
+// this to size the buffers we hand to nginx.
+size_t
+output_buffer_size(ngx_http_request_t* r);
 
 StringPiece
 str_to_string_piece(ngx_str_t s);
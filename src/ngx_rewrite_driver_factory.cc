@@ -21,6 +21,7 @@
 
 #include <cstdio>
 
+#include "net/instaweb/automatic/public/flush_early_flow.h"
 #include "net/instaweb/http/public/content_type.h"
 #include "net/instaweb/http/public/fake_url_async_fetcher.h"
 #include "net/instaweb/http/public/http_cache.h"
@@ -53,6 +54,10 @@
 #include "net/instaweb/util/public/cache_stats.h"
 #include "net/instaweb/util/public/cache_batcher.h"
 #include "net/instaweb/util/public/fallback_cache.h"
+#include "ngx_base_fetch.h"
+#include "ngx_gzip_resource_cache.h"
+#include "ngx_html_result_cache.h"
+#include "ngx_url_async_fetcher.h"
 #include "ngx_cache.h"
 #include "net/instaweb/apache/apr_thread_compatible_pool.h"
 #include "net/instaweb/apache/serf_url_async_fetcher.h"
@@ -71,16 +76,48 @@ class UrlFetcher;
 class Writer;
 
 const char NgxRewriteDriverFactory::kMemcached[] = "memcached";
+const char NgxRewriteDriverFactory::kHtmlFlushes[] =
+    "ngx_pagespeed_html_flushes";
+const char NgxRewriteDriverFactory::kHtmlFlushedResponses[] =
+    "ngx_pagespeed_html_flushed_responses";
+const char NgxRewriteDriverFactory::kFlushEarlyResponses[] =
+    "ngx_pagespeed_flush_early_responses";
+const char NgxRewriteDriverFactory::kResourceFileCacheHits[] =
+    "ngx_pagespeed_resource_file_cache_hits";
+const char NgxRewriteDriverFactory::kCoalescedFetches[] =
+    "ngx_pagespeed_coalesced_fetches";
+const char NgxRewriteDriverFactory::kCoalesceTimeouts[] =
+    "ngx_pagespeed_coalesce_timeouts";
+const char NgxRewriteDriverFactory::kHtmlRewritesShed[] =
+    "ngx_pagespeed_html_rewrites_shed";
+const char NgxRewriteDriverFactory::kHtmlDeadlinePassthroughs[] =
+    "ngx_pagespeed_html_deadline_passthroughs";
+const char NgxRewriteDriverFactory::kHtmlDeadlinesMissed[] =
+    "ngx_pagespeed_html_deadlines_missed";
 
 NgxRewriteDriverFactory::NgxRewriteDriverFactory() :
   shared_mem_runtime_(new NullSharedMem()),
   cache_hasher_(20) {
   RewriteDriverFactory::InitStats(&simple_stats_);
   SerfUrlAsyncFetcher::InitStats(&simple_stats_);
+  FlushEarlyFlow::InitStats(&simple_stats_);
+  NgxBaseFetch::InitStats(&simple_stats_);
+  NgxHtmlResultCache::InitStats(&simple_stats_);
+  NgxUrlAsyncFetcher::InitStats(&simple_stats_);
+  NgxGzipResourceCache::InitStats(&simple_stats_);
   AprMemCache::InitStats(&simple_stats_);
   CacheStats::InitStats(NgxCache::kFileCache, &simple_stats_);
   CacheStats::InitStats(NgxCache::kLruCache, &simple_stats_);
   CacheStats::InitStats(kMemcached, &simple_stats_);
+  simple_stats_.AddVariable(kHtmlFlushes);
+  simple_stats_.AddVariable(kHtmlFlushedResponses);
+  simple_stats_.AddVariable(kFlushEarlyResponses);
+  simple_stats_.AddVariable(kResourceFileCacheHits);
+  simple_stats_.AddVariable(kCoalescedFetches);
+  simple_stats_.AddVariable(kCoalesceTimeouts);
+  simple_stats_.AddVariable(kHtmlRewritesShed);
+  simple_stats_.AddVariable(kHtmlDeadlinePassthroughs);
+  simple_stats_.AddVariable(kHtmlDeadlinesMissed);
   SetStatistics(&simple_stats_);
   timer_ = DefaultTimer();
   apr_initialize();
@@ -106,6 +143,12 @@ NgxRewriteDriverFactory::~NgxRewriteDriverFactory() {
     CacheInterface* memcached = p->second;
     defer_cleanup(new Deleter<CacheInterface>(memcached));
   }
+
+  for (FetcherMap::iterator p = fetcher_map_.begin(),
+           e = fetcher_map_.end(); p != e; ++p) {
+    NgxUrlAsyncFetcher* fetcher = p->second;
+    defer_cleanup(new Deleter<NgxUrlAsyncFetcher>(fetcher));
+  }
 }
 
 const char NgxRewriteDriverFactory::kStaticJavaScriptPrefix[] =
@@ -305,6 +348,55 @@ CacheInterface* NgxRewriteDriverFactory::GetMemcached(
   return memcached;
 }
 
+NgxUrlAsyncFetcher* NgxRewriteDriverFactory::GetNgxFetcher(
+    NgxRewriteOptions* options, ngx_conf_t* cf) {
+  const GoogleString& resolver_spec = options->fetcher_resolver();
+  GoogleString key = StrCat(
+      resolver_spec, ",", Integer64ToString(options->fetcher_timeout_ms()),
+      ",", Integer64ToString(options->fetcher_max_connections()));
+  StrAppend(&key, ",",
+            Integer64ToString(options->fetcher_keepalive_connections()));
+  FetcherMap::iterator iter = fetcher_map_.find(key);
+  if (iter != fetcher_map_.end()) {
+    return iter->second;
+  }
+
+  ngx_resolver_t* resolver = NULL;
+  if (!resolver_spec.empty()) {
+    // The resolver keeps pointing at the name for its log messages.
+    ngx_str_t name;
+    name.len = resolver_spec.size();
+    name.data = static_cast<u_char*>(ngx_pnalloc(cf->pool, name.len));
+    if (name.data == NULL) {
+      return NULL;
+    }
+    ngx_memcpy(name.data, resolver_spec.data(), name.len);
+    resolver = ngx_resolver_create(cf, &name, 1);
+    if (resolver == NULL) {
+      message_handler()->Message(
+          kError, "couldn't set up FetcherResolver %s", resolver_spec.c_str());
+      return NULL;
+    }
+  }
+
+  NgxUrlAsyncFetcher* fetcher = new NgxUrlAsyncFetcher(
+      resolver, options->fetcher_timeout_ms(),
+      options->fetcher_max_connections(),
+      options->fetcher_keepalive_connections(),
+      ComputeUrlAsyncFetcher(), thread_system(), statistics(),
+      message_handler());
+  fetcher_map_[key] = fetcher;
+  return fetcher;
+}
+
+void NgxRewriteDriverFactory::InitNgxFetchers(NgxFetchQueue* queue,
+                                              ngx_log_t* log) {
+  for (FetcherMap::iterator p = fetcher_map_.begin(),
+           e = fetcher_map_.end(); p != e; ++p) {
+    p->second->Init(queue, log);
+  }
+}
+
 CacheInterface* NgxRewriteDriverFactory::GetFilesystemMetadataCache(
     NgxRewriteOptions* options) {
   // Reuse the memcached server(s) for the filesystem metadata cache. We need
@@ -19,6 +19,11 @@
 #ifndef NGX_REWRITE_DRIVER_FACTORY_H_
 #define NGX_REWRITE_DRIVER_FACTORY_H_
 
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
 #include "base/scoped_ptr.h"
 #include "net/instaweb/rewriter/public/rewrite_driver_factory.h"
 #include "net/instaweb/util/public/md5_hasher.h"
@@ -41,11 +46,32 @@ class NgxRewriteOptions;
 class AprMemCache;
 class CacheInterface;
 class AsyncCache;
+class NgxFetchQueue;
+class NgxUrlAsyncFetcher;
 
 class NgxRewriteDriverFactory : public RewriteDriverFactory {
  public:
   static const char kStaticJavaScriptPrefix[];
   static const char kMemcached[];
+  // Flushes of upstream HTML into the rewriter, and the responses they were
+  // for; flushes per response is the ratio.
+  static const char kHtmlFlushes[];
+  static const char kHtmlFlushedResponses[];
+  // Html responses that started with a head from FlushEarlyFlow.
+  static const char kFlushEarlyResponses[];
+  // .pagespeed. resources served straight from the file cache.
+  static const char kResourceFileCacheHits[];
+  // .pagespeed. resource requests that waited for an identical one in flight,
+  // and those of them that gave up waiting.
+  static const char kCoalescedFetches[];
+  static const char kCoalesceTimeouts[];
+  // Html responses passed through unrewritten because the worker was too busy.
+  static const char kHtmlRewritesShed[];
+  // Html responses that hit HtmlRewriteDeadlineMs and were sent as they came
+  // from upstream, and those we couldn't because the original was too big to
+  // keep.
+  static const char kHtmlDeadlinePassthroughs[];
+  static const char kHtmlDeadlinesMissed[];
 
   NgxRewriteDriverFactory();
   virtual ~NgxRewriteDriverFactory();
@@ -93,6 +119,17 @@ class NgxRewriteDriverFactory : public RewriteDriverFactory {
   // Returns the filesystem metadata cache for the given config's specification
   // (if it has one). NULL is returned if no cache is specified.
   CacheInterface* GetFilesystemMetadataCache(NgxRewriteOptions* config);
+
+  // Finds a native fetcher for the fetcher settings in the config, creating
+  // one if none exists yet.  Server blocks with the same settings share a
+  // fetcher, and so its idle connections.  cf is used to set up the resolver.
+  // Returns NULL if the settings are invalid.
+  NgxUrlAsyncFetcher* GetNgxFetcher(NgxRewriteOptions* config, ngx_conf_t* cf);
+
+  // Hooks the native fetchers up to this worker's event loop.  Called once
+  // per worker process, after the fork.
+  void InitNgxFetchers(NgxFetchQueue* queue, ngx_log_t* log);
+
 private:
   SimpleStats simple_stats_;
   Timer* timer_;
@@ -124,6 +161,10 @@ private:
   std::vector<AprMemCache*> memcache_servers_;
   std::vector<AsyncCache*> async_caches_;
 
+  // Keyed on all the fetcher settings, like the caches above.
+  typedef std::map<GoogleString, NgxUrlAsyncFetcher*> FetcherMap;
+  FetcherMap fetcher_map_;
+
   DISALLOW_COPY_AND_ASSIGN(NgxRewriteDriverFactory);
 };
 
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_rewrite_driver_pool.h"
+
+#include "net/instaweb/rewriter/public/furious_util.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/rewriter/public/server_context.h"
+#include "net/instaweb/util/public/stl_util.h"
+
+namespace net_instaweb {
+
+NgxRewriteDriverPool::NgxRewriteDriverPool(ServerContext* server_context,
+                                           RewriteOptions* options)
+    : RewriteDriverPool(server_context),
+      options_(options) {
+  options_->ComputeSignature(server_context->lock_hasher());
+}
+
+NgxRewriteDriverPool::~NgxRewriteDriverPool() {
+}
+
+RewriteOptions* NgxRewriteDriverPool::TargetOptions() const {
+  return options_.get();
+}
+
+NgxRewriteDriverPools::NgxRewriteDriverPools(ServerContext* server_context,
+                                             const RewriteOptions& options)
+    : pool_(new NgxRewriteDriverPool(server_context, options.Clone())) {
+  if (!options.running_furious()) {
+    return;
+  }
+
+  // Build the options each experiment state would get from
+  // FuriousMatcher::ClassifyIntoExperiment().
+  experiment_pools_[furious::kFuriousNoExperiment] = NULL;
+  for (int i = 0, n = options.num_furious_experiments(); i < n; ++i) {
+    experiment_pools_[options.furious_spec(i)->id()] = NULL;
+  }
+  for (ExperimentPoolMap::iterator p = experiment_pools_.begin(),
+           e = experiment_pools_.end(); p != e; ++p) {
+    RewriteOptions* arm_options = options.Clone();
+    arm_options->SetFuriousState(p->first);
+    p->second = new NgxRewriteDriverPool(server_context, arm_options);
+  }
+}
+
+NgxRewriteDriverPools::~NgxRewriteDriverPools() {
+  STLDeleteValues(&experiment_pools_);
+}
+
+RewriteDriverPool* NgxRewriteDriverPools::ExperimentPool(int furious_state) {
+  ExperimentPoolMap::iterator p = experiment_pools_.find(furious_state);
+  return p == experiment_pools_.end() ? NULL : p->second;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Rewrite driver pools for options we know at configuration time.
+//
+// Requests that use location-specific options, or that fall into an
+// experiment arm, used to get their own Clone() of the options and a freshly
+// built custom rewrite driver.  Instead we build the final options for each
+// location and experiment arm once, while loading the configuration, and keep
+// a pool of rewrite drivers for each.  Drivers from a pool are reused like the
+// ones ServerContext::NewRewriteDriver() hands out, so such requests no longer
+// copy options or recompute their signature.
+
+#ifndef NGX_REWRITE_DRIVER_POOL_H_
+#define NGX_REWRITE_DRIVER_POOL_H_
+
+#include <map>
+
+#include "base/scoped_ptr.h"
+#include "net/instaweb/rewriter/public/rewrite_driver_pool.h"
+#include "net/instaweb/util/public/basictypes.h"
+
+namespace net_instaweb {
+
+class RewriteOptions;
+class ServerContext;
+
+// A pool of rewrite drivers that all use one fixed set of options.
+class NgxRewriteDriverPool : public RewriteDriverPool {
+ public:
+  // Takes ownership of options, which must not be modified afterwards.
+  NgxRewriteDriverPool(ServerContext* server_context, RewriteOptions* options);
+  virtual ~NgxRewriteDriverPool();
+
+  virtual RewriteOptions* TargetOptions() const;
+
+ private:
+  scoped_ptr<RewriteOptions> options_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxRewriteDriverPool);
+};
+
+// The driver pools for one configuration scope: one for its own options and,
+// if it's running an experiment, one per experiment state.
+class NgxRewriteDriverPools {
+ public:
+  // Builds all the pools from options, which is copied.
+  NgxRewriteDriverPools(ServerContext* server_context,
+                        const RewriteOptions& options);
+  ~NgxRewriteDriverPools();
+
+  // For requests that aren't in an experiment.
+  RewriteDriverPool* pool() { return pool_.get(); }
+
+  // For requests already assigned to furious_state, or NULL if we don't have a
+  // pool for that state and the caller needs to classify the request itself.
+  RewriteDriverPool* ExperimentPool(int furious_state);
+
+ private:
+  typedef std::map<int, NgxRewriteDriverPool*> ExperimentPoolMap;
+
+  scoped_ptr<NgxRewriteDriverPool> pool_;
+  ExperimentPoolMap experiment_pools_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxRewriteDriverPools);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_REWRITE_DRIVER_POOL_H_
@@ -27,6 +27,7 @@ extern "C" {
 #include "ngx_pagespeed.h"
 #include "net/instaweb/public/version.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/util/public/string_util.h"
 #include "net/instaweb/util/public/timer.h"
 
 namespace net_instaweb {
@@ -35,7 +36,57 @@ const char NgxRewriteOptions::kClassName[] = "NgxRewriteOptions";
 
 RewriteOptions::Properties* NgxRewriteOptions::ngx_properties_ = NULL;
 
-NgxRewriteOptions::NgxRewriteOptions() {
+const NgxRewriteOptions::Int64Directive
+NgxRewriteOptions::kInt64Directives[] = {
+  { "MaxBufferedOutputBytes",
+    &NgxRewriteOptions::max_buffered_output_bytes_, 0 },
+  { "MaxWorkerBufferedOutputBytes",
+    &NgxRewriteOptions::max_worker_buffered_output_bytes_, 0 },
+  { "MaxSpilledOutputBytes", &NgxRewriteOptions::max_spilled_output_bytes_, 0 },
+  { "OutputSegmentBytes", &NgxRewriteOptions::output_segment_bytes_, 0 },
+  { "FlushBufferBytes", &NgxRewriteOptions::flush_buffer_bytes_, 0 },
+  { "FlushDelayMs", &NgxRewriteOptions::flush_delay_ms_, 0 },
+  { "MinFlushIntervalMs", &NgxRewriteOptions::min_flush_interval_ms_, 0 },
+  { "HtmlResultCacheTtlMs", &NgxRewriteOptions::html_result_cache_ttl_ms_, 0 },
+  { "FetcherTimeoutMs", &NgxRewriteOptions::fetcher_timeout_ms_, 0 },
+  { "FetcherMaxConnections", &NgxRewriteOptions::fetcher_max_connections_, 0 },
+  { "FetcherKeepaliveConnections",
+    &NgxRewriteOptions::fetcher_keepalive_connections_, 0 },
+  { "CoalesceWaitMs", &NgxRewriteOptions::coalesce_wait_ms_, 0 },
+  { "GzipResourceLevel", &NgxRewriteOptions::gzip_resource_level_, 9 },
+  { "MaxHtmlRewritesInFlight",
+    &NgxRewriteOptions::max_html_rewrites_in_flight_, 0 },
+  { "MaxHtmlRewriteLatencyMs",
+    &NgxRewriteOptions::max_html_rewrite_latency_ms_, 0 },
+  { "HtmlRewriteDeadlineMs", &NgxRewriteOptions::html_rewrite_deadline_ms_, 0 },
+};
+
+const NgxRewriteOptions::BoolDirective
+NgxRewriteOptions::kBoolDirectives[] = {
+  { "UseNativeFetcher", &NgxRewriteOptions::use_native_fetcher_ },
+  { "LoadFromRoot", &NgxRewriteOptions::load_from_root_ },
+};
+
+NgxRewriteOptions::NgxRewriteOptions()
+    : max_buffered_output_bytes_(1024 * 1024),  // 1MB
+      max_worker_buffered_output_bytes_(64 * 1024 * 1024),  // 64MB
+      max_spilled_output_bytes_(256 * 1024 * 1024),  // 256MB
+      output_segment_bytes_(32 * 1024),  // 32k
+      flush_buffer_bytes_(16 * 1024),  // 16k
+      flush_delay_ms_(100),
+      min_flush_interval_ms_(10),
+      html_result_cache_ttl_ms_(0),
+      use_native_fetcher_(false),
+      fetcher_resolver_(""),
+      fetcher_timeout_ms_(2500),
+      fetcher_max_connections_(100),
+      fetcher_keepalive_connections_(32),
+      gzip_resource_level_(0),
+      load_from_root_(false),
+      coalesce_wait_ms_(0),
+      max_html_rewrites_in_flight_(0),
+      max_html_rewrite_latency_ms_(0),
+      html_rewrite_deadline_ms_(0) {
   Init();
 }
 
@@ -102,6 +153,16 @@ bool NgxRewriteOptions::IsDirective(StringPiece config_directive,
   return StringCaseEqual(config_directive, compare_directive);
 }
 
+bool NgxRewriteOptions::ParseNonNegativeInt64(StringPiece arg, int64* value,
+                                              GoogleString* msg) {
+  bool ok = StringToInt64(arg.as_string().c_str(), value);
+  if (!ok || *value < 0) {
+    *msg = "must be a non-negative 64-bit integer";
+    return false;
+  }
+  return true;
+}
+
 RewriteOptions::OptionSettingResult NgxRewriteOptions::ParseAndSetOptions0(
     StringPiece directive, GoogleString* msg, MessageHandler* handler) {
   if (IsDirective(directive, "on")) {
@@ -134,6 +195,38 @@ RewriteOptions::OptionSettingResult NgxRewriteOptions::ParseAndSetOptions1(
     return result;
   }
 
+  for (size_t i = 0; i < arraysize(kInt64Directives); ++i) {
+    const Int64Directive& int64_directive = kInt64Directives[i];
+    if (IsDirective(directive, int64_directive.name)) {
+      int64 value;
+      if (!ParseNonNegativeInt64(arg, &value, msg)) {
+        return RewriteOptions::kOptionValueInvalid;
+      }
+      if (int64_directive.max_value > 0 &&
+          value > int64_directive.max_value) {
+        *msg = StrCat("must be between 0 and ",
+                      Integer64ToString(int64_directive.max_value));
+        return RewriteOptions::kOptionValueInvalid;
+      }
+      (this->*int64_directive.setting).set(value);
+      return RewriteOptions::kOptionOk;
+    }
+  }
+  for (size_t i = 0; i < arraysize(kBoolDirectives); ++i) {
+    const BoolDirective& bool_directive = kBoolDirectives[i];
+    if (IsDirective(directive, bool_directive.name)) {
+      if (IsDirective(arg, "on")) {
+        (this->*bool_directive.setting).set(true);
+      } else if (IsDirective(arg, "off")) {
+        (this->*bool_directive.setting).set(false);
+      } else {
+        *msg = "must be on or off";
+        return RewriteOptions::kOptionValueInvalid;
+      }
+      return RewriteOptions::kOptionOk;
+    }
+  }
+
   if (IsDirective(directive, "Allow")) {
     Allow(arg);
   } else if (IsDirective(directive, "DangerPermitFetchFromUnknownHosts")) {
@@ -182,6 +275,8 @@ RewriteOptions::OptionSettingResult NgxRewriteOptions::ParseAndSetOptions1(
     RetainComment(arg);
   } else if (IsDirective(directive, "BlockingRewriteKey")) {
     set_blocking_rewrite_key(arg);
+  } else if (IsDirective(directive, "FetcherResolver")) {
+    set_fetcher_resolver(arg.as_string());
   } else {
     return RewriteOptions::kOptionNameUnknown;
   }
@@ -200,6 +295,8 @@ RewriteOptions::OptionSettingResult NgxRewriteOptions::ParseAndSetOptions2(
     domain_lawyer()->AddShard(arg1, arg2, handler);
   } else if (IsDirective(directive, "CustomFetchHeader")) {
     AddCustomFetchHeader(arg1, arg2);
+  } else if (IsDirective(directive, "LoadFromFile")) {
+    file_load_policy()->Associate(arg1, arg2);
   } else {
     return RewriteOptions::kOptionNameUnknown;
   }
@@ -303,6 +400,35 @@ NgxRewriteOptions* NgxRewriteOptions::Clone() const {
   return options;
 }
 
+void NgxRewriteOptions::Merge(const RewriteOptions& src) {
+  RewriteOptions::Merge(src);
+
+  const NgxRewriteOptions* ngx_src = DynamicCast(&src);
+  if (ngx_src != NULL) {
+    max_buffered_output_bytes_.Merge(ngx_src->max_buffered_output_bytes_);
+    max_worker_buffered_output_bytes_.Merge(
+        ngx_src->max_worker_buffered_output_bytes_);
+    max_spilled_output_bytes_.Merge(ngx_src->max_spilled_output_bytes_);
+    output_segment_bytes_.Merge(ngx_src->output_segment_bytes_);
+    flush_buffer_bytes_.Merge(ngx_src->flush_buffer_bytes_);
+    flush_delay_ms_.Merge(ngx_src->flush_delay_ms_);
+    min_flush_interval_ms_.Merge(ngx_src->min_flush_interval_ms_);
+    html_result_cache_ttl_ms_.Merge(ngx_src->html_result_cache_ttl_ms_);
+    use_native_fetcher_.Merge(ngx_src->use_native_fetcher_);
+    fetcher_resolver_.Merge(ngx_src->fetcher_resolver_);
+    fetcher_timeout_ms_.Merge(ngx_src->fetcher_timeout_ms_);
+    fetcher_max_connections_.Merge(ngx_src->fetcher_max_connections_);
+    fetcher_keepalive_connections_.Merge(
+        ngx_src->fetcher_keepalive_connections_);
+    gzip_resource_level_.Merge(ngx_src->gzip_resource_level_);
+    load_from_root_.Merge(ngx_src->load_from_root_);
+    coalesce_wait_ms_.Merge(ngx_src->coalesce_wait_ms_);
+    max_html_rewrites_in_flight_.Merge(ngx_src->max_html_rewrites_in_flight_);
+    max_html_rewrite_latency_ms_.Merge(ngx_src->max_html_rewrite_latency_ms_);
+    html_rewrite_deadline_ms_.Merge(ngx_src->html_rewrite_deadline_ms_);
+  }
+}
+
 const NgxRewriteOptions* NgxRewriteOptions::DynamicCast(
     const RewriteOptions* instance) {
   return (instance == NULL ||
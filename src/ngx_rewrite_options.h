@@ -61,6 +61,10 @@ class NgxRewriteOptions : public RewriteOptions {
   // Make an identical copy of these options and return it.
   virtual NgxRewriteOptions* Clone() const;
 
+  // Merge src into this, including our nginx-specific settings if src is an
+  // NgxRewriteOptions.
+  virtual void Merge(const RewriteOptions& src);
+
   // Returns a suitably down cast version of 'instance' if it is an instance
   // of this class, NULL if not.
   static const NgxRewriteOptions* DynamicCast(const RewriteOptions* instance);
@@ -125,7 +129,149 @@ class NgxRewriteOptions : public RewriteOptions {
   void set_memcached_threads(int x) {
     set_option(x, &memcached_threads_);
   }
+
+  // Settings below only affect how nginx moves bytes around, not how anything
+  // is rewritten, so they're kept out of the RewriteOptions properties and the
+  // signature.
+  int64 max_buffered_output_bytes() const {
+    return max_buffered_output_bytes_.value();
+  }
+  void set_max_buffered_output_bytes(int64 x) {
+    max_buffered_output_bytes_.set(x);
+  }
+  int64 max_worker_buffered_output_bytes() const {
+    return max_worker_buffered_output_bytes_.value();
+  }
+  void set_max_worker_buffered_output_bytes(int64 x) {
+    max_worker_buffered_output_bytes_.set(x);
+  }
+  int64 max_spilled_output_bytes() const {
+    return max_spilled_output_bytes_.value();
+  }
+  void set_max_spilled_output_bytes(int64 x) {
+    max_spilled_output_bytes_.set(x);
+  }
+  int64 output_segment_bytes() const {
+    return output_segment_bytes_.value();
+  }
+  void set_output_segment_bytes(int64 x) {
+    output_segment_bytes_.set(x);
+  }
+  int64 flush_buffer_bytes() const {
+    return flush_buffer_bytes_.value();
+  }
+  void set_flush_buffer_bytes(int64 x) {
+    flush_buffer_bytes_.set(x);
+  }
+  int64 flush_delay_ms() const {
+    return flush_delay_ms_.value();
+  }
+  void set_flush_delay_ms(int64 x) {
+    flush_delay_ms_.set(x);
+  }
+  int64 min_flush_interval_ms() const {
+    return min_flush_interval_ms_.value();
+  }
+  void set_min_flush_interval_ms(int64 x) {
+    min_flush_interval_ms_.set(x);
+  }
+  int64 html_result_cache_ttl_ms() const {
+    return html_result_cache_ttl_ms_.value();
+  }
+  void set_html_result_cache_ttl_ms(int64 x) {
+    html_result_cache_ttl_ms_.set(x);
+  }
+  bool use_native_fetcher() const {
+    return use_native_fetcher_.value();
+  }
+  void set_use_native_fetcher(bool x) {
+    use_native_fetcher_.set(x);
+  }
+  const GoogleString& fetcher_resolver() const {
+    return fetcher_resolver_.value();
+  }
+  void set_fetcher_resolver(const GoogleString& x) {
+    fetcher_resolver_.set(x);
+  }
+  int64 fetcher_timeout_ms() const {
+    return fetcher_timeout_ms_.value();
+  }
+  void set_fetcher_timeout_ms(int64 x) {
+    fetcher_timeout_ms_.set(x);
+  }
+  int64 fetcher_max_connections() const {
+    return fetcher_max_connections_.value();
+  }
+  void set_fetcher_max_connections(int64 x) {
+    fetcher_max_connections_.set(x);
+  }
+  int64 fetcher_keepalive_connections() const {
+    return fetcher_keepalive_connections_.value();
+  }
+  void set_fetcher_keepalive_connections(int64 x) {
+    fetcher_keepalive_connections_.set(x);
+  }
+  int64 gzip_resource_level() const {
+    return gzip_resource_level_.value();
+  }
+  void set_gzip_resource_level(int64 x) {
+    gzip_resource_level_.set(x);
+  }
+  bool load_from_root() const {
+    return load_from_root_.value();
+  }
+  void set_load_from_root(bool x) {
+    load_from_root_.set(x);
+  }
+  int64 coalesce_wait_ms() const {
+    return coalesce_wait_ms_.value();
+  }
+  void set_coalesce_wait_ms(int64 x) {
+    coalesce_wait_ms_.set(x);
+  }
+  int64 max_html_rewrites_in_flight() const {
+    return max_html_rewrites_in_flight_.value();
+  }
+  void set_max_html_rewrites_in_flight(int64 x) {
+    max_html_rewrites_in_flight_.set(x);
+  }
+  int64 max_html_rewrite_latency_ms() const {
+    return max_html_rewrite_latency_ms_.value();
+  }
+  void set_max_html_rewrite_latency_ms(int64 x) {
+    max_html_rewrite_latency_ms_.set(x);
+  }
+  int64 html_rewrite_deadline_ms() const {
+    return html_rewrite_deadline_ms_.value();
+  }
+  void set_html_rewrite_deadline_ms(int64 x) {
+    html_rewrite_deadline_ms_.set(x);
+  }
+
  private:
+  // A setting that isn't a RewriteOptions property.  Remembers whether it was
+  // set so merging only overrides values from explicit directives.
+  template<class T>
+  class NgxSetting {
+   public:
+    explicit NgxSetting(T default_value)
+        : value_(default_value), was_set_(false) {}
+    const T& value() const { return value_; }
+    void set(const T& value) {
+      value_ = value;
+      was_set_ = true;
+    }
+    void Merge(const NgxSetting<T>& src) {
+      if (src.was_set_) {
+        set(src.value_);
+      }
+    }
+
+   private:
+    T value_;
+    bool was_set_;
+  };
+
   // Used by class_name() and DynamicCast() to provide error checking.
   static const char kClassName[];
 
@@ -179,6 +325,26 @@ class NgxRewriteOptions : public RewriteOptions {
   // ignoring case.
   bool IsDirective(StringPiece config_directive, StringPiece compare_directive);
 
+  // Helper for ParseAndSetOptions1.  Parses arg as a non-negative int64 into
+  // value, setting msg on failure.
+  static bool ParseNonNegativeInt64(StringPiece arg, int64* value,
+                                    GoogleString* msg);
+
+  // The nginx-specific directives that take a non-negative integer or on/off,
+  // and the settings they set.  ParseAndSetOptions1 looks directives up here
+  // before trying the ones that need their own handling.
+  struct Int64Directive {
+    const char* name;
+    NgxSetting<int64> NgxRewriteOptions::*setting;
+    int64 max_value;  // 0 for no limit.
+  };
+  struct BoolDirective {
+    const char* name;
+    NgxSetting<bool> NgxRewriteOptions::*setting;
+  };
+  static const Int64Directive kInt64Directives[];
+  static const BoolDirective kBoolDirectives[];
+
   Option<GoogleString> file_cache_path_;
   Option<int64> file_cache_clean_inode_limit_;
   Option<int64> file_cache_clean_interval_ms_;
@@ -191,6 +357,63 @@ class NgxRewriteOptions : public RewriteOptions {
   // for code that parses it.
   Option<GoogleString> memcached_servers_;
 
+  // Memory we'll hold rewritten output in, per request and per worker, while
+  // waiting for slow clients before further output goes to a temp file.  0
+  // means no limit.
+  NgxSetting<int64> max_buffered_output_bytes_;
+  NgxSetting<int64> max_worker_buffered_output_bytes_;
+  // Most output one request may have in its temp file before it fails.  0
+  // means no limit.
+  NgxSetting<int64> max_spilled_output_bytes_;
+  // Largest piece of output handed to nginx at once, raised to the location's
+  // postpone_output.
+  NgxSetting<int64> output_segment_bytes_;
+  // Input from upstream is flushed through the rewriter once this many bytes
+  // are waiting, once the oldest has waited flush_delay_ms_, or at </head>,
+  // but never within min_flush_interval_ms_ of the previous flush.
+  NgxSetting<int64> flush_buffer_bytes_;
+  NgxSetting<int64> flush_delay_ms_;
+  NgxSetting<int64> min_flush_interval_ms_;
+
+  // How long to reuse rewritten html for identical upstream html.  0 turns the
+  // html result cache off.
+  NgxSetting<int64> html_result_cache_ttl_ms_;
+
+  // Fetch resources with nginx's own event loop instead of serf.  The other
+  // fetcher settings only apply to the native fetcher, and are per worker.
+  NgxSetting<bool> use_native_fetcher_;
+  // Name server address for looking up hosts.  Without one only ip addresses
+  // can be fetched.
+  NgxSetting<GoogleString> fetcher_resolver_;
+  NgxSetting<int64> fetcher_timeout_ms_;
+  // Fetches in flight at once; more wait for one to finish.
+  NgxSetting<int64> fetcher_max_connections_;
+  // Idle connections kept open for reuse.
+  NgxSetting<int64> fetcher_keepalive_connections_;
+
+  // zlib level for the gzipped copies of .pagespeed. css and javascript we
+  // cache.  0 turns them off.
+  NgxSetting<int64> gzip_resource_level_;
+
+  // Read this server's static resources from its root and alias directories
+  // instead of fetching them over http.
+  NgxSetting<bool> load_from_root_;
+
+  // How long a request for a .pagespeed. resource waits for an identical one
+  // already in flight, in this worker or another, before fetching it itself.
+  // 0 turns waiting off.
+  NgxSetting<int64> coalesce_wait_ms_;
+
+  // Load shedding: html is passed through unrewritten while a worker has this
+  // many html responses in pagespeed, or while the 99th percentile of its
+  // recent rewrite times is over the latency limit.  0 means no limit.
+  NgxSetting<int64> max_html_rewrites_in_flight_;
+  NgxSetting<int64> max_html_rewrite_latency_ms_;
+
+  // If pagespeed hasn't sent any of an html response this long after the
+  // headers, send the original html instead.  0 means no deadline.
+  NgxSetting<int64> html_rewrite_deadline_ms_;
+
   DISALLOW_COPY_AND_ASSIGN(NgxRewriteOptions);
 };
 
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unbounded wait-free queue for exactly one producer thread and one consumer
+// thread.  Based on Dmitry Vyukov's unbounded SPSC queue: the producer reuses
+// nodes the consumer has moved past, so once warmed up neither side allocates.
+//
+// Push() may only be called from the producer and Pop() only from the
+// consumer.  Construction and destruction must not race with either.
+
+#ifndef NGX_SPSC_QUEUE_H_
+#define NGX_SPSC_QUEUE_H_
+
+#include <cstddef>
+
+#include "net/instaweb/util/public/basictypes.h"
+
+namespace net_instaweb {
+
+template<class T>
+class NgxSpscQueue {
+ public:
+  NgxSpscQueue() {
+    Node* node = new Node;
+    node->next = NULL;
+    tail_ = head_ = first_ = tail_copy_ = node;
+  }
+
+  ~NgxSpscQueue() {
+    Node* node = first_;
+    while (node != NULL) {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  void Push(T value) {
+    Node* node = AllocNode();
+    node->next = NULL;
+    node->value = value;
+    // Publish the value before the link.
+    __sync_synchronize();
+    head_->next = node;
+    head_ = node;
+  }
+
+  // Returns false if the queue is empty.
+  bool Pop(T* value) {
+    Node* next = tail_->next;
+    if (next == NULL) {
+      return false;
+    }
+    // Read the value only after seeing the link.
+    __sync_synchronize();
+    *value = next->value;
+    // The producer may reuse the old tail once it sees this.
+    __sync_synchronize();
+    tail_ = next;
+    return true;
+  }
+
+ private:
+  struct Node {
+    Node* volatile next;
+    T value;
+  };
+
+  // Producer only.
+  Node* AllocNode() {
+    if (first_ == tail_copy_) {
+      tail_copy_ = tail_;
+      __sync_synchronize();
+    }
+    if (first_ != tail_copy_) {
+      Node* node = first_;
+      first_ = first_->next;
+      return node;
+    }
+    return new Node;
+  }
+
+  // Consumer side: the most recently consumed node.
+  Node* volatile tail_;
+
+  // Producer side: the last node pushed, the oldest node not yet reused, and
+  // the last value of tail_ we saw.
+  Node* head_;
+  Node* first_;
+  Node* tail_copy_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSpscQueue);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_SPSC_QUEUE_H_
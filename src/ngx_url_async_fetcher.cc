@@ -0,0 +1,232 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_url_async_fetcher.h"
+
+#include "ngx_fetch.h"
+#include "ngx_fetch_queue.h"
+
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/util/public/function.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/statistics.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// How long an idle connection is kept for reuse.
+const ngx_msec_t kIdleTimeoutMs = 60 * 1000;
+
+// Threads that run the AsyncFetch callbacks, and the sequences fetches are
+// spread over.  A fetch keeps to one sequence so its callbacks stay in order.
+const int kCallbackThreads = 2;
+const int kCallbackSequences = 8;
+
+}  // namespace
+
+const char NgxUrlAsyncFetcher::kFetches[] = "ngx_fetcher_fetches";
+const char NgxUrlAsyncFetcher::kFailures[] = "ngx_fetcher_failures";
+const char NgxUrlAsyncFetcher::kTimeouts[] = "ngx_fetcher_timeouts";
+const char NgxUrlAsyncFetcher::kKeepaliveReuses[] =
+    "ngx_fetcher_keepalive_reuses";
+
+void NgxUrlAsyncFetcher::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kFetches);
+  statistics->AddVariable(kFailures);
+  statistics->AddVariable(kTimeouts);
+  statistics->AddVariable(kKeepaliveReuses);
+}
+
+NgxUrlAsyncFetcher::NgxUrlAsyncFetcher(ngx_resolver_t* resolver,
+                                       ngx_msec_t timeout_ms,
+                                       ngx_uint_t max_connections,
+                                       ngx_uint_t max_keepalive_connections,
+                                       UrlAsyncFetcher* fallback,
+                                       ThreadSystem* thread_system,
+                                       Statistics* statistics,
+                                       MessageHandler* handler)
+    : resolver_(resolver),
+      timeout_ms_(timeout_ms),
+      max_connections_(max_connections),
+      max_keepalive_connections_(max_keepalive_connections),
+      fallback_(fallback),
+      thread_system_(thread_system),
+      message_handler_(handler),
+      queue_(NULL),
+      log_(NULL),
+      active_(0),
+      shut_down_(false),
+      next_callback_sequence_(0),
+      fetches_(statistics->GetVariable(kFetches)),
+      failures_(statistics->GetVariable(kFailures)),
+      timeouts_(statistics->GetVariable(kTimeouts)),
+      keepalive_reuses_(statistics->GetVariable(kKeepaliveReuses)) {
+}
+
+NgxUrlAsyncFetcher::~NgxUrlAsyncFetcher() {
+  ShutDown();
+}
+
+void NgxUrlAsyncFetcher::Init(NgxFetchQueue* queue, ngx_log_t* log) {
+  queue_ = queue;
+  log_ = log;
+  callback_pool_.reset(new QueuedWorkerPool(kCallbackThreads, thread_system_));
+  for (int i = 0; i < kCallbackSequences; ++i) {
+    callback_sequences_.push_back(callback_pool_->NewSequence());
+  }
+}
+
+QueuedWorkerPool::Sequence* NgxUrlAsyncFetcher::NextCallbackSequence() {
+  if (callback_sequences_.empty()) {
+    return NULL;  // Shut down.
+  }
+  QueuedWorkerPool::Sequence* sequence =
+      callback_sequences_[next_callback_sequence_];
+  next_callback_sequence_ =
+      (next_callback_sequence_ + 1) % callback_sequences_.size();
+  return sequence;
+}
+
+bool NgxUrlAsyncFetcher::Fetch(const GoogleString& url,
+                               MessageHandler* message_handler,
+                               AsyncFetch* async_fetch) {
+  if (queue_ == NULL) {
+    message_handler->Message(
+        kError, "NgxUrlAsyncFetcher: fetch of %s outside a worker",
+        url.c_str());
+    async_fetch->Done(false);
+    return true;
+  }
+
+  NgxFetch* fetch = new NgxFetch(url, async_fetch, message_handler, this);
+  queue_->Run(MakeFunction(this, &NgxUrlAsyncFetcher::StartFetch, fetch));
+  return false;
+}
+
+void NgxUrlAsyncFetcher::StartFetch(NgxFetch* fetch) {
+  fetches_->Add(1);
+  if (max_connections_ != 0 && active_ >= max_connections_ && !shut_down_) {
+    waiting_.push_back(fetch);
+    return;
+  }
+  ++active_;
+  if (shut_down_) {
+    fetch->Cancel();
+  } else {
+    fetch->Start();
+  }
+}
+
+void NgxUrlAsyncFetcher::FetchComplete(bool success, bool timed_out) {
+  if (!success) {
+    failures_->Add(1);
+  }
+  if (timed_out) {
+    timeouts_->Add(1);
+  }
+  --active_;
+  if (!waiting_.empty() && !shut_down_) {
+    NgxFetch* fetch = waiting_.front();
+    waiting_.pop_front();
+    ++active_;
+    fetch->Start();
+  }
+}
+
+void NgxUrlAsyncFetcher::ShutDown() {
+  shut_down_ = true;
+  while (!idle_.empty()) {
+    CloseIdleConnection(idle_.front());
+  }
+  while (!waiting_.empty()) {
+    NgxFetch* fetch = waiting_.front();
+    waiting_.pop_front();
+    ++active_;
+    fetch->Cancel();
+  }
+  // Waits for running callbacks and cancels queued ones, which fails their
+  // fetches.  The pool owns the sequences.
+  if (callback_pool_.get() != NULL) {
+    callback_pool_->ShutDown();
+  }
+  callback_sequences_.clear();
+}
+
+ngx_connection_t* NgxUrlAsyncFetcher::TakeIdleConnection(
+    const GoogleString& host_port) {
+  // Most recently used first, as it's the least likely to have been closed.
+  for (IdleList::reverse_iterator i = idle_.rbegin(); i != idle_.rend(); ++i) {
+    IdleConnection* idle = *i;
+    if (idle->host_port == host_port) {
+      ngx_connection_t* c = idle->connection;
+      idle_.erase(--i.base());
+      delete idle;
+      if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+      }
+      c->idle = 0;
+      keepalive_reuses_->Add(1);
+      return c;
+    }
+  }
+  return NULL;
+}
+
+void NgxUrlAsyncFetcher::KeepIdleConnection(const GoogleString& host_port,
+                                            ngx_connection_t* c) {
+  if (shut_down_ || max_keepalive_connections_ == 0) {
+    ngx_close_connection(c);
+    return;
+  }
+  if (idle_.size() >= max_keepalive_connections_) {
+    CloseIdleConnection(idle_.front());
+  }
+
+  IdleConnection* idle = new IdleConnection;
+  idle->fetcher = this;
+  idle->host_port = host_port;
+  idle->connection = c;
+
+  c->data = idle;
+  c->idle = 1;
+  c->read->handler = IdleReadHandler;
+  c->write->handler = IdleReadHandler;
+  ngx_add_timer(c->read, kIdleTimeoutMs);
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    ngx_close_connection(c);
+    delete idle;
+    return;
+  }
+  idle_.push_back(idle);
+}
+
+void NgxUrlAsyncFetcher::IdleReadHandler(ngx_event_t* ev) {
+  if (ev->write) {
+    return;
+  }
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(ev->data);
+  IdleConnection* idle = static_cast<IdleConnection*>(c->data);
+  idle->fetcher->CloseIdleConnection(idle);
+}
+
+void NgxUrlAsyncFetcher::CloseIdleConnection(IdleConnection* idle) {
+  idle_.remove(idle);
+  ngx_close_connection(idle->connection);
+  delete idle;
+}
+
+}  // namespace net_instaweb
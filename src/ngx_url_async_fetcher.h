@@ -0,0 +1,162 @@
+/*
+ * Copyright 2012 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Fetches resources using the worker's own event loop instead of serf.
+//
+// Fetch() is called on rewrite threads.  It only queues the fetch for the
+// worker; resolving, connecting, and reading the response all happen on the
+// worker's event loop, in NgxFetch.  Idle connections are kept around per
+// host:port so later fetches from the same origin skip the connect.
+//
+// The AsyncFetch callbacks (HeadersComplete, Write, Done) can do real work,
+// like writing to the cache or starting a rewrite, so NgxFetch doesn't call
+// them on the event loop.  It posts them to a small thread pool instead, on
+// one of a few sequences so each fetch's callbacks still run in order.
+//
+// Only A records are looked up, so hosts without an IPv4 address are handed
+// to the fallback fetcher (serf) with a logged message.  IPv6 literals are
+// fetched natively when nginx was built with IPv6 support.
+//
+// There is one fetcher per distinct fetcher configuration, shared by all the
+// server blocks that use it.  Each worker gets its own copy when nginx forks,
+// and Init() then ties that copy to the worker's NgxFetchQueue.
+
+#ifndef NGX_URL_ASYNC_FETCHER_H_
+#define NGX_URL_ASYNC_FETCHER_H_
+
+extern "C" {
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+}
+
+#include <deque>
+#include <list>
+#include <vector>
+
+#include "net/instaweb/http/public/url_async_fetcher.h"
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/queued_worker_pool.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/string.h"
+
+namespace net_instaweb {
+
+class AsyncFetch;
+class MessageHandler;
+class NgxFetch;
+class NgxFetchQueue;
+class Statistics;
+class ThreadSystem;
+class Variable;
+
+class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
+ public:
+  static const char kFetches[];
+  static const char kFailures[];
+  static const char kTimeouts[];
+  static const char kKeepaliveReuses[];
+
+  static void InitStats(Statistics* statistics);
+
+  // resolver may be NULL, in which case only urls with IP addresses for hosts
+  // can be fetched.  max_connections of 0 means no limit.  fallback, which
+  // may be NULL, gets the fetches we can't resolve to an IPv4 address.
+  NgxUrlAsyncFetcher(ngx_resolver_t* resolver, ngx_msec_t timeout_ms,
+                     ngx_uint_t max_connections,
+                     ngx_uint_t max_keepalive_connections,
+                     UrlAsyncFetcher* fallback, ThreadSystem* thread_system,
+                     Statistics* statistics, MessageHandler* handler);
+  virtual ~NgxUrlAsyncFetcher();
+
+  // Called in each worker process, after the fork.  Until this is called all
+  // fetches fail.  Starts the callback threads.
+  void Init(NgxFetchQueue* queue, ngx_log_t* log);
+
+  virtual bool Fetch(const GoogleString& url,
+                     MessageHandler* message_handler,
+                     AsyncFetch* fetch);
+  virtual void ShutDown();
+
+  // The rest is for NgxFetch, and must only be called on the worker.
+  ngx_resolver_t* resolver() { return resolver_; }
+  ngx_msec_t timeout_ms() const { return timeout_ms_; }
+  ngx_log_t* log() { return log_; }
+  UrlAsyncFetcher* fallback() { return fallback_; }
+
+  // The sequence a new fetch should post its AsyncFetch callbacks to, or NULL
+  // once we've shut down and they should run right away.
+  QueuedWorkerPool::Sequence* NextCallbackSequence();
+
+  // Returns an idle connection to host_port, or NULL if there isn't one.
+  ngx_connection_t* TakeIdleConnection(const GoogleString& host_port);
+
+  // Holds on to c for a later fetch from host_port, or closes it if we
+  // already have enough idle connections.
+  void KeepIdleConnection(const GoogleString& host_port, ngx_connection_t* c);
+
+  // Called by a fetch once it's done, successfully or not.  Starts the next
+  // waiting fetch, if any.
+  void FetchComplete(bool success, bool timed_out);
+
+ private:
+  struct IdleConnection {
+    NgxUrlAsyncFetcher* fetcher;
+    GoogleString host_port;
+    ngx_connection_t* connection;
+  };
+  typedef std::list<IdleConnection*> IdleList;
+
+  // Runs on the worker, from the fetch queue.
+  void StartFetch(NgxFetch* fetch);
+
+  // Closes idle connections that the other end closed, sent something on, or
+  // that sat unused too long.
+  static void IdleReadHandler(ngx_event_t* ev);
+  void CloseIdleConnection(IdleConnection* idle);
+
+  ngx_resolver_t* resolver_;
+  ngx_msec_t timeout_ms_;
+  ngx_uint_t max_connections_;
+  ngx_uint_t max_keepalive_connections_;
+  UrlAsyncFetcher* fallback_;
+  ThreadSystem* thread_system_;
+  MessageHandler* message_handler_;
+  NgxFetchQueue* queue_;
+  ngx_log_t* log_;
+
+  // Fetches in progress, and ones waiting for one of those to finish.
+  ngx_uint_t active_;
+  std::deque<NgxFetch*> waiting_;
+  // Least recently used first.
+  IdleList idle_;
+  bool shut_down_;
+
+  scoped_ptr<QueuedWorkerPool> callback_pool_;
+  std::vector<QueuedWorkerPool::Sequence*> callback_sequences_;
+  size_t next_callback_sequence_;
+
+  Variable* fetches_;
+  Variable* failures_;
+  Variable* timeouts_;
+  Variable* keepalive_reuses_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxUrlAsyncFetcher);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_URL_ASYNC_FETCHER_H_
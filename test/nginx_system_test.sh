@@ -17,8 +17,7 @@
 # Author: jefftk@google.com (Jeff Kaufman)
 #
 #
-# Runs pagespeed's generic system test.  Will eventually run nginx-specific
-# tests as well.
+# Runs pagespeed's generic system test, then the nginx-specific tests.
 #
 # Exits with status 0 if all tests pass.
 # Exits with status 1 immediately if any test fails.
@@ -27,13 +26,21 @@
 # Usage:
 #   Set up nginx to serve mod_pagespeed/src/install/ statically at the server
 #   root, then run:
-#     ./ngx_system_test.sh HOST:PORT
+#     ./ngx_system_test.sh HOST:PORT [SECONDARY_HOST:PORT]
 #   for example:
-#     ./ngx_system_test.sh localhost:8050
+#     ./ngx_system_test.sh localhost:8050 127.0.0.1:8051
+#
+#   Most nginx-specific tests run against SECONDARY_HOST:PORT, a second server
+#   set up as in the README, and are skipped without it.
 #
 
 this_dir="$( dirname "$0" )"
 
+PRIMARY_HOSTNAME="$1"
+SECONDARY_HOSTNAME="$2"
+# The generic test only knows about the first server.
+set -- "$1"
+
 SYSTEM_TEST_FILE="$this_dir/../../mod_pagespeed/src/install/system_test.sh"
 
 if [ ! -e "$SYSTEM_TEST_FILE" ] ; then
@@ -45,10 +52,186 @@ fi
 PSA_JS_LIBRARY_URL_PREFIX="ngx_pagespeed_static"
 
 PAGESPEED_EXPECTED_FAILURES="
-  ~compression is enabled for rewritten JS.~
   ~convert_meta_tags~
   ~regression test with same filtered input twice in combination~
 "
 
 source $SYSTEM_TEST_FILE
+
+# nginx-specific tests.
+CURL=${CURL:-curl}
+
+start_test static snippets are served gzipped and revalidated by ETag
+$WGET -q -O $OUTDIR/ngx_defer.html \
+  "$EXAMPLE_ROOT/defer_javascript.html?ModPagespeedFilters=defer_javascript"
+STATIC_PATH=$(grep -o '/ngx_pagespeed_static/js_defer[^"]*' \
+  $OUTDIR/ngx_defer.html | head -n 1)
+check [ -n "$STATIC_PATH" ]
+STATIC_URL="http://$PRIMARY_HOSTNAME$STATIC_PATH"
+$CURL -sS -H 'Accept-Encoding: gzip' -D $OUTDIR/ngx_static_headers \
+  -o $OUTDIR/ngx_static.js.gz "$STATIC_URL"
+check grep -qi '^Content-Encoding: gzip' $OUTDIR/ngx_static_headers
+check gzip -t $OUTDIR/ngx_static.js.gz
+STATIC_ETAG=$(grep -i '^ETag:' $OUTDIR/ngx_static_headers | cut -d ' ' -f 2- |
+  tr -d '\r')
+check [ -n "$STATIC_ETAG" ]
+check [ "$($CURL -sS -o /dev/null -w '%{http_code}' \
+  -H "If-None-Match: $STATIC_ETAG" "$STATIC_URL")" = 304 ]
+
+if [ -z "$SECONDARY_HOSTNAME" ]; then
+  echo "No SECONDARY_HOST:PORT given, so skipping tests that need it."
+else
+  SECONDARY_ROOT="http://$SECONDARY_HOSTNAME"
+
+  # The secondary server's root, which we fill in.  Names that change each run
+  # keep cached results from earlier runs out of the way.
+  NGX_TEST_DIR=${NGX_TEST_DIR:-/tmp/ngx_pagespeed_test}
+  mkdir -p "$NGX_TEST_DIR"
+  rm -f "$NGX_TEST_DIR"/ngx_*
+  NGX_CSS=ngx_$$.css
+  for i in $(seq 1 20); do
+    echo "/* comment $i */"
+    echo ".class$i {"
+    echo "  color: red;"
+    echo "}"
+  done > "$NGX_TEST_DIR/$NGX_CSS"
+  NGX_HEAD="<html><head><link rel=\"stylesheet\" href=\"/$NGX_CSS\"></head>"
+  echo "$NGX_HEAD<body><p>hello</p></body></html>" > \
+    "$NGX_TEST_DIR/ngx_test.html"
+  # About 600k, so it spans many output segments.
+  {
+    echo "$NGX_HEAD<body>"
+    for i in $(seq 1 10000); do
+      echo "<p>paragraph $i of a page that takes many output segments</p>"
+    done
+    echo "</body></html>"
+  } > "$NGX_TEST_DIR/ngx_large.html"
+
+  start_test large html comes through pagespeed intact
+  # With no filters pagespeed passes the html through unchanged, so this checks
+  # that every output segment reaches the client, in order.
+  $CURL -sS -o $OUTDIR/ngx_large.html \
+    "$SECONDARY_ROOT/ngx_large.html?ModPagespeedFilters="
+  check cmp "$NGX_TEST_DIR/ngx_large.html" $OUTDIR/ngx_large.html
+
+  start_test slow clients get all of a response past MaxBufferedOutputBytes
+  # The secondary server keeps only 4k per request in memory, so most of this
+  # waits for the client in the spill file.
+  $CURL -sS --limit-rate 200k -o $OUTDIR/ngx_large_slow.html \
+    "$SECONDARY_ROOT/ngx_large.html?ModPagespeedFilters="
+  check cmp "$NGX_TEST_DIR/ngx_large.html" $OUTDIR/ngx_large_slow.html
+
+  start_test in-place optimization serves the original, then the optimized css
+  IPRO_CSS=ngx_ipro_$$.css
+  cp "$NGX_TEST_DIR/$NGX_CSS" "$NGX_TEST_DIR/$IPRO_CSS"
+  # A miss: the file as nginx has it, which pagespeed records to optimize.
+  $CURL -sS -o $OUTDIR/$IPRO_CSS "$SECONDARY_ROOT/$IPRO_CSS"
+  check cmp "$NGX_TEST_DIR/$IPRO_CSS" $OUTDIR/$IPRO_CSS
+  # Then hits, once it's optimized: minified css, at the same url.
+  fetch_until "$SECONDARY_ROOT/$IPRO_CSS" 'grep -c comment' 0
+
+  start_test the native fetcher fetches resources to rewrite
+  # The secondary server uses UseNativeFetcher, and is addressed by ip so it
+  # needs no resolver.
+  fetch_until "$SECONDARY_ROOT/ngx_test.html" 'grep -c \.pagespeed\.' 1
+  $CURL -sS -o $OUTDIR/ngx_test.html "$SECONDARY_ROOT/ngx_test.html"
+  CSS_URL=$(grep -o '[^"]*\.pagespeed\.[^"]*\.css' $OUTDIR/ngx_test.html)
+  if [ "${CSS_URL#http}" = "$CSS_URL" ]; then
+    CSS_URL="$SECONDARY_ROOT$CSS_URL"
+  fi
+  $CURL -sS -o $OUTDIR/ngx_css -D $OUTDIR/ngx_css_headers "$CSS_URL"
+  check grep -q '^HTTP/1.1 200' $OUTDIR/ngx_css_headers
+  check grep -q 'color:red' $OUTDIR/ngx_css
+  check_not grep -q comment $OUTDIR/ngx_css
+
+  start_test rewritten css is gzipped for clients that accept it
+  # The secondary server sets GzipResourceLevel.
+  $CURL -sS -H 'Accept-Encoding: gzip' -o $OUTDIR/ngx_css.gz \
+    -D $OUTDIR/ngx_css_gz_headers "$CSS_URL"
+  check grep -qi '^Content-Encoding: gzip' $OUTDIR/ngx_css_gz_headers
+  check grep -qi '^Vary:.*Accept-Encoding' $OUTDIR/ngx_css_gz_headers
+  gunzip -c $OUTDIR/ngx_css.gz > $OUTDIR/ngx_css_gunzipped
+  check cmp $OUTDIR/ngx_css $OUTDIR/ngx_css_gunzipped
+
+  start_test rewritten css answers HEAD and Range requests
+  $CURL -sS -I -o $OUTDIR/ngx_css_head_headers "$CSS_URL"
+  check grep -q '^HTTP/1.1 200' $OUTDIR/ngx_css_head_headers
+  $CURL -sS -r 0-9 -o $OUTDIR/ngx_css_range \
+    -D $OUTDIR/ngx_css_range_headers "$CSS_URL"
+  check grep -q '^HTTP/1.1 206' $OUTDIR/ngx_css_range_headers
+  head -c 10 $OUTDIR/ngx_css > $OUTDIR/ngx_css_first_10
+  check cmp $OUTDIR/ngx_css_first_10 $OUTDIR/ngx_css_range
+
+  start_test rewritten css is revalidated with a 304
+  CSS_ETAG=$(grep -i '^ETag:' $OUTDIR/ngx_css_headers | cut -d ' ' -f 2- |
+    tr -d '\r')
+  CSS_LAST_MODIFIED=$(grep -i '^Last-Modified:' $OUTDIR/ngx_css_headers |
+    cut -d ' ' -f 2- | tr -d '\r')
+  check [ -n "$CSS_ETAG$CSS_LAST_MODIFIED" ]
+  if [ -n "$CSS_ETAG" ]; then
+    check [ "$($CURL -sS -o /dev/null -w '%{http_code}' \
+      -H "If-None-Match: $CSS_ETAG" "$CSS_URL")" = 304 ]
+    # Only a matching ETag is a revalidation.
+    check [ "$($CURL -sS -o /dev/null -w '%{http_code}' \
+      -H 'If-None-Match: "ngx-no-such-etag"' "$CSS_URL")" = 200 ]
+  fi
+  if [ -n "$CSS_LAST_MODIFIED" ]; then
+    check [ "$($CURL -sS -o /dev/null -w '%{http_code}' \
+      -H "If-Modified-Since: $CSS_LAST_MODIFIED" "$CSS_URL")" = 304 ]
+  fi
+
+  start_test rewritten css comes back intact from the file cache
+  # By now both variants are in the file cache, so these are served from there.
+  $CURL -sS -o $OUTDIR/ngx_css_cached -D $OUTDIR/ngx_css_cached_headers \
+    "$CSS_URL"
+  check grep -q '^HTTP/1.1 200' $OUTDIR/ngx_css_cached_headers
+  check cmp $OUTDIR/ngx_css $OUTDIR/ngx_css_cached
+  CSS_LENGTH=$(grep -i '^Content-Length:' $OUTDIR/ngx_css_cached_headers |
+    cut -d ' ' -f 2 | tr -d '\r')
+  check [ "$CSS_LENGTH" = "$(wc -c < $OUTDIR/ngx_css_cached | tr -d ' ')" ]
+  $CURL -sS -H 'Accept-Encoding: gzip' -o $OUTDIR/ngx_css_cached.gz \
+    -D $OUTDIR/ngx_css_cached_gz_headers "$CSS_URL"
+  check grep -qi '^Content-Encoding: gzip' $OUTDIR/ngx_css_cached_gz_headers
+  gunzip -c $OUTDIR/ngx_css_cached.gz > $OUTDIR/ngx_css_cached_gunzipped
+  check cmp $OUTDIR/ngx_css $OUTDIR/ngx_css_cached_gunzipped
+
+  start_test concurrent requests for one uncached resource all get it
+  # The secondary server sets CoalesceWaitMs, so all but one of these wait for
+  # the first to finish instead of rewriting the css themselves.
+  COALESCE_CSS=ngx_coalesce_$$.css
+  cp "$NGX_TEST_DIR/$NGX_CSS" "$NGX_TEST_DIR/$COALESCE_CSS"
+  COALESCE_URL="$SECONDARY_ROOT/$COALESCE_CSS.pagespeed.cf.0.css"
+  for i in $(seq 1 10); do
+    $CURL -sS -o $OUTDIR/ngx_coalesce_$i -w '%{http_code}' "$COALESCE_URL" \
+      > $OUTDIR/ngx_coalesce_status_$i &
+  done
+  wait
+  for i in $(seq 1 10); do
+    check [ "$(cat $OUTDIR/ngx_coalesce_status_$i)" = 200 ]
+    check cmp $OUTDIR/ngx_coalesce_1 $OUTDIR/ngx_coalesce_$i
+  done
+  check grep -q 'color:red' $OUTDIR/ngx_coalesce_1
+
+  start_test html is passed through unrewritten past HtmlRewriteDeadlineMs
+  # /ngx_deadline/ gives pagespeed 1ms to start sending, which it usually
+  # can't manage, so nginx sends the original page instead.
+  fetch_until "$SECONDARY_ROOT/ngx_deadline/ngx_test.html" \
+    'grep -c \.pagespeed\.' 0
+
+  start_test gzipped html from upstream is rewritten
+  # /ngx_gzip_upstream/ proxies to /ngx_plain/, which gzips without pagespeed.
+  fetch_until "$SECONDARY_ROOT/ngx_gzip_upstream/ngx_test.html" \
+    'grep -c \.pagespeed\.' 1
+
+  start_test html is passed through unrewritten past MaxHtmlRewriteLatencyMs
+  # /ngx_shed/ allows 1ms, which rewriting the large page takes longer than.
+  # The css it links is already optimized, so a rewritten page would link the
+  # .pagespeed. url.  Build up enough rewrite times to shed by first.
+  for i in $(seq 1 30); do
+    $CURL -sS -o /dev/null "$SECONDARY_ROOT/ngx_shed/ngx_large.html"
+  done
+  fetch_until "$SECONDARY_ROOT/ngx_shed/ngx_large.html" \
+    'grep -c \.pagespeed\.' 0
+fi
+
 system_test_trailer